@@ -0,0 +1,107 @@
+/**
+ * parser.c - Micro-benchmark of the HTTP request parser.
+ *
+ * Parses a typical browser request (request line and a dozen headers) over
+ * and over and reports the parsing speed in bytes per cycle. Cycles are read
+ * from the time stamp counter, which ticks at a constant rate that may differ
+ * from the current core clock; compare results on the same machine only.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "http.h"
+
+#define ITERATIONS 1000000
+
+static const char request[] =
+    "GET /assets/js/vendor/jquery-3.6.0.min.js?v=20231015 HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"118\", \"Google Chrome\";v=\"118\", "
+    "\"Not=A?Brand\";v=\"99\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, "
+    "like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+    "sec-ch-ua-platform: \"Linux\"\r\n"
+    "Accept: */*\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Dest: script\r\n"
+    "Referer: https://www.example.com/products/index.html\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9,de;q=0.8\r\n"
+    "If-Modified-Since: Sat, 14 Oct 2023 08:12:31 GMT\r\n"
+    "\r\n";
+
+static inline unsigned long long cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+/**
+ * @brief Parses the request once.
+ *
+ * @return int 0 on success.
+ */
+static int parse_once(http_request_t *r, size_t len)
+{
+    r->pos = 0;
+    r->last = len;
+    r->state = 0;
+    r->request_end = NULL;
+
+    if (http_parse_request_line(r) != 0 || http_parse_request_body(r) != 0)
+        return -1;
+
+    list_head *pos, *n;
+    list_for_each_safe (pos, n, &(r->list)) {
+        list_del(pos);
+        http_header_free(r, list_entry(pos, http_header_t, list));
+    }
+    r->nheaders = 0;
+    return 0;
+}
+
+int main()
+{
+    size_t len = sizeof(request) - 1;
+    static char buf[MAX_BUF];
+    static http_header_t headers[MAX_HEADERS];
+    http_request_t r;
+
+    http_parser_init();
+    init_http_request(&r, -1, -1, NULL);
+    r.buf = buf;
+    r.headers = headers;
+    memcpy(buf, request, len);
+
+    /* Warm up caches and branch predictors */
+    for (int i = 0; i < ITERATIONS / 10; i++) {
+        if (parse_once(&r, len) != 0) {
+            fprintf(stderr, "Failed to parse the request\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    unsigned long long start = cycles();
+    for (int i = 0; i < ITERATIONS; i++)
+        parse_once(&r, len);
+    unsigned long long elapsed = cycles() - start;
+
+    printf("%zu bytes x %d requests: %.1f cycles/request, %.3f bytes/cycle\n",
+           len, ITERATIONS, (double) elapsed / ITERATIONS,
+           (double) len * ITERATIONS / elapsed);
+    return 0;
+}
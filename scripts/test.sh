@@ -4,6 +4,17 @@
 source scripts/util.sh
 
 LOCAL_PORT="8081"
+URL=http://127.0.0.1:$LOCAL_PORT
+
+# Web root of the functional checks, removed on exit
+TEST_ROOT=$(mktemp -d)
+TEST_FILES=$TEST_ROOT/test-
+trap 'rm -rf $TEST_ROOT $SERVER_LOG' EXIT
+# Diagnostics of the server, checked by some of the checks
+SERVER_LOG=$(mktemp)
+cp www/index.html $TEST_ROOT
+
+failures=0
 
 wait_server() {
     local port
@@ -11,17 +22,43 @@ wait_server() {
     for i in {1..20}; do
         # sleep first because this maybe called immediately after server start
         sleep 0.1
-        nc -z -w 4 127.0.0.1 $port && break
+        (exec 3<>/dev/tcp/127.0.0.1/$port) 2>/dev/null && break
     done
 }
 
 start_http_server() {
-    ./sehttpd &	
+    ./sehttpd -w $TEST_ROOT "$@" 2>$SERVER_LOG &
     server_pid=$!
+    wait_server $LOCAL_PORT
 }
 
 stop_http_server() {
+    local workers
+    # worker processes (-P) exit with the server, but not at once
+    workers=$(pgrep -P $server_pid)
     kill $server_pid
+    wait $server_pid 2>/dev/null
+    while kill -0 $workers 2>/dev/null; do
+        sleep 0.1
+    done
+    # an io_uring instance, and the listening socket its accept holds, are
+    # released by the kernel some time after the process exits
+    while (exec 3<>/dev/tcp/127.0.0.1/$LOCAL_PORT) 2>/dev/null; do
+        sleep 0.1
+    done
+}
+
+# Prints the outcome of a check and counts the failures
+report() {
+    local name status
+    name=$1
+    status=$2
+    if [ "$status" -eq 0 ]; then
+        printf "  %-48s OK\n" "$name"
+    else
+        printf "  %-48s FAILED\n" "$name"
+        failures=$((failures + 1))
+    fi
 }
 
 test_server_local() {
@@ -35,9 +72,522 @@ test_server_local() {
     done
 }
 
+# Sends raw requests on one connection and prints everything received until
+# the server closes it, or fails if it does not within 2 seconds. Each
+# argument goes in one write, with a pause before the next one.
+send_raw() {
+    local req out part
+    exec 3<>/dev/tcp/127.0.0.1/$LOCAL_PORT || return 1
+    for part in "$@"; do
+        [ "$part" = "$1" ] || sleep 0.1
+        printf -v req -- "$part"
+        echo -n "$req" >&3
+    done
+    # bodies may hold NUL bytes, which shell variables cannot
+    out=$(set -o pipefail; timeout 2 cat <&3 | tr -d '\0') ||
+        { exec 3<&-; return 1; }
+    exec 3<&-
+    printf "%s" "$out"
+}
+
+# Downloads a file and compares it with the one served; parallel downloads
+# of one file pass a second argument to keep their copies apart. A transfer
+# that stalls for 10 seconds fails rather than being retried.
+check_download() {
+    local name out
+    name=$1
+    out=$TEST_FILES$name.out$2
+    wget -q -t 1 -T 10 -O $out $URL/test-$name &&
+        cmp -s $TEST_FILES$name $out
+}
+
+# A file much larger than the socket send buffer arrives byte for byte
+test_large_file() {
+    check_download large.bin
+}
+
+# Several large files are sent at once without mixing up their queues
+test_concurrent_downloads() {
+    local pids status
+    for i in 1 2 3 4; do
+        check_download large.bin $i &
+        pids+=" $!"
+    done
+    status=0
+    for pid in $pids; do
+        wait $pid || status=1
+    done
+    return $status
+}
+
+# A client that stops reading for longer than the keep-alive timeout, with a
+# response larger than the socket buffers still to come, gets all of it
+test_slow_reader() {
+    exec 3<>/dev/tcp/127.0.0.1/$LOCAL_PORT || return 1
+    printf "GET /test-slow.bin HTTP/1.1\r\nHost: localhost\r\n\r\n" >&3
+    { head -c $((1 << 20)); sleep 1.5; timeout 10 cat; } <&3 \
+        > ${TEST_FILES}slow.out
+    exec 3<&-
+    tail -c $((32 << 20)) ${TEST_FILES}slow.out | cmp -s - ${TEST_FILES}slow.bin
+}
+
+# Bodies copied behind their header and bodies sent after it both arrive
+# whole, on either side of the inline limit
+test_small_files() {
+    local size
+    for size in 0 1 4095 4096 4097; do
+        head -c $size /dev/urandom > ${TEST_FILES}$size.bin
+        check_download $size.bin || return 1
+    done
+}
+
+# Prints the milliseconds since the epoch
+now_ms() {
+    echo $(($(date +%s%N) / 1000000))
+}
+
+# An idle keep-alive connection is closed once its timeout (500 ms by
+# default) expires, and not long before or after
+test_keepalive_timeout() {
+    local start out elapsed
+    start=$(now_ms)
+    out=$(send_raw "GET /test-1.bin HTTP/1.1\r\nConnection: keep-alive\r\n\r\n")
+    [ $? -eq 0 ] || return 1
+    elapsed=$(($(now_ms) - start))
+    [[ "$out" == "HTTP/1.1 200"* ]] && [ $elapsed -ge 400 ] &&
+        [ $elapsed -le 1500 ]
+}
+
+# Twice as many keep-alive connections as the limit: all are served, the
+# four oldest are closed as the others arrive, and the next one as soon as
+# it has been idle for the keep-alive timeout shrunk at the limit, long
+# before the usual 500 ms
+test_connection_limit() {
+    local i fd fds req out start status
+    printf -v req "GET /test-1.bin HTTP/1.1\r\nConnection: keep-alive\r\n\r\n"
+    start=$(now_ms)
+    for i in $(seq 1 8); do
+        exec {fd}<>/dev/tcp/127.0.0.1/$LOCAL_PORT || return 1
+        echo -n "$req" >&$fd
+        fds+=" $fd"
+        sleep 0.02
+    done
+    status=0
+    i=0
+    for fd in $fds; do
+        out=$(set -o pipefail; timeout 1 cat <&$fd | tr -d '\0') &&
+            [[ "$out" == "HTTP/1.1 200"* ]] || status=1
+        exec {fd}<&-
+        i=$((i + 1))
+        [ $i -eq 5 ] && [ $(($(now_ms) - start)) -ge 400 ] && status=1
+    done
+    return $status
+}
+
+# As many keep-alive connections as the limit, opened at once: one of them
+# is closed once idle for the keep-alive timeout shrunk at the limit, with
+# nothing but that timeout to wake the server up for it
+test_limit_keepalive() {
+    local i fd fds req out start closed
+    printf -v req "GET /test-1.bin HTTP/1.1\r\nConnection: keep-alive\r\n\r\n"
+    start=$(now_ms)
+    for i in 1 2 3 4; do
+        exec {fd}<>/dev/tcp/127.0.0.1/$LOCAL_PORT || return 1
+        echo -n "$req" >&$fd
+        fds+=" $fd"
+    done
+    out=$(timeout 1 cat <&${fds##* } | tr -d '\0')
+    closed=$(($(now_ms) - start))
+    for fd in $fds; do
+        exec {fd}<&-
+    done
+    [[ "$out" == "HTTP/1.1 200"* ]] && [ $closed -lt 300 ]
+}
+
+# Connections whose clients have yet to read their responses are not closed
+# to make room at the limit of four, even with no idle one left: a new
+# connection is turned away instead
+test_limit_spares_busy() {
+    local i fd fds status
+    for i in 1 2 3 4; do
+        exec {fd}<>/dev/tcp/127.0.0.1/$LOCAL_PORT || return 1
+        printf "GET /test-slow.bin HTTP/1.1\r\nHost: localhost\r\n\r\n" >&$fd
+        head -c $((1 << 20)) <&$fd > ${TEST_FILES}busy.out$i
+        fds+=" $fd"
+    done
+    curl -s -m 2 -o /dev/null $URL/
+    status=0
+    i=0
+    for fd in $fds; do
+        i=$((i + 1))
+        timeout 10 cat <&$fd >> ${TEST_FILES}busy.out$i
+        exec {fd}<&-
+        tail -c $((32 << 20)) ${TEST_FILES}busy.out$i |
+            cmp -s - ${TEST_FILES}slow.bin || status=1
+        rm -f ${TEST_FILES}busy.out$i
+    done
+    return $status
+}
+
+# A cached file is served again from memory, and a file rewritten in place
+# with the same size is not served stale
+test_cached_file() {
+    echo first > ${TEST_FILES}cached.txt
+    check_download cached.txt && check_download cached.txt || return 1
+    echo other > ${TEST_FILES}cached.txt
+    # give the server time to read the change from inotify
+    sleep 0.2
+    check_download cached.txt
+}
+
+# Prints the status code of a GET for the given path
+http_status() {
+    curl -s -o /dev/null -w "%{http_code}" $URL/$1
+}
+
+# Cached files and their metadata are dropped when inotify reports a change:
+# rewritten, removed and created files, and a renamed directory
+test_cache_invalidation() {
+    rm -rf $TEST_ROOT/dir $TEST_ROOT/old
+    mkdir $TEST_ROOT/dir
+    echo first > $TEST_ROOT/dir/a.txt
+    rm -f ${TEST_FILES}new.txt
+    check_download cached.txt && [ "$(http_status dir/a.txt)" = 200 ] &&
+        [ "$(http_status test-new.txt)" = 404 ] || return 1
+
+    echo stale > ${TEST_FILES}cached.txt
+    rm $TEST_ROOT/dir/a.txt
+    echo new > ${TEST_FILES}new.txt
+    sleep 0.2
+    check_download cached.txt && check_download new.txt &&
+        [ "$(http_status dir/a.txt)" = 404 ] || return 1
+
+    echo moved > $TEST_ROOT/dir/a.txt
+    [ "$(http_status dir/a.txt)" = 200 ] || return 1
+    mv $TEST_ROOT/dir $TEST_ROOT/old
+    sleep 0.2
+    [ "$(http_status dir/a.txt)" = 404 ] &&
+        [ "$(http_status old/a.txt)" = 200 ]
+}
+
+# A large file kept open is served with its new content once it is
+# rewritten in place or replaced by another file
+test_open_file() {
+    head -c $((1 << 20)) /dev/urandom > ${TEST_FILES}open.bin
+    check_download open.bin || return 1
+    head -c $((1 << 20)) /dev/urandom > ${TEST_FILES}open.bin
+    sleep 0.2
+    check_download open.bin || return 1
+    head -c $((2 << 20)) /dev/urandom > ${TEST_FILES}open.new
+    mv ${TEST_FILES}open.new ${TEST_FILES}open.bin
+    sleep 0.2
+    check_download open.bin
+}
+
+# More large files than the server keeps open, so idle descriptors are
+# closed while others are in use
+test_open_file_limit() {
+    local i
+    for i in $(seq 1 300); do
+        head -c $((80 << 10)) /dev/urandom > ${TEST_FILES}$i.fd
+    done
+    for i in $(seq 1 300) $(seq 1 20); do
+        check_download $i.fd || return 1
+    done
+}
+
+# A killed worker process is restarted and its listener served again
+test_worker_restart() {
+    local i
+    pkill -9 -P $server_pid || return 1
+    sleep 0.2
+    [ "$(pgrep -c -P $server_pid)" -eq 2 ] || return 1
+    for i in $(seq 1 20); do
+        check_download 4096.bin || return 1
+    done
+}
+
+# More clients connecting at once than a pass of the event loop accepts
+# are all served
+test_connection_burst() {
+    local i pids status
+    for i in $(seq 1 100); do
+        check_download 4096.bin $i &
+        pids+=" $!"
+    done
+    status=0
+    for pid in $pids; do
+        wait $pid || status=1
+    done
+    return $status
+}
+
+# Prints how many objects each pool has in use, from a new report
+pools_in_use() {
+    kill -USR1 $server_pid
+    sleep 0.2
+    awk '/^Worker/ { s = "" } / pool:/ { s = s $1 " " $3 " " } END { print s }' \
+        $SERVER_LOG
+}
+
+# More connections at once than objects preallocated in the pools; every
+# connection object, buffer and header array is back in its pool afterwards
+test_request_pool() {
+    local i pids status idle
+    idle=$(pools_in_use)
+    for i in $(seq 1 40); do
+        check_download 4096.bin $i &
+        pids+=" $!"
+    done
+    for i in 1 2 3 4; do
+        check_download large.bin $i &
+        pids+=" $!"
+    done
+    status=0
+    for pid in $pids; do
+        wait $pid || status=1
+    done
+    [ $status -eq 0 ] && [ -n "$idle" ] && [ "$(pools_in_use)" = "$idle" ]
+}
+
+# Clients that hang up in the middle of large downloads leave nothing
+# behind in the pools, once the server has noticed
+test_aborted_download() {
+    local i idle
+    idle=$(pools_in_use)
+    for i in 1 2 3 4; do
+        curl -s $URL/test-large.bin | head -c 100000 > /dev/null
+    done
+    for i in $(seq 1 20); do
+        [ -n "$idle" ] && [ "$(pools_in_use)" = "$idle" ] && return 0
+    done
+    return 1
+}
+
+# More files than the cache budget holds, each fetched twice, so that
+# entries are evicted while others are served
+test_cache_eviction() {
+    local i
+    for i in $(seq 1 40); do
+        head -c $((60 << 10)) /dev/urandom > ${TEST_FILES}$i.lru
+    done
+    for i in $(seq 1 40) $(seq 1 40); do
+        check_download $i.lru || return 1
+    done
+}
+
+# Requests with few headers, with more than a request has records for and
+# with many more are all served, twice on one keep-alive connection
+test_many_headers() {
+    local n i args out
+    for n in 5 40 100; do
+        args=(-H "Connection: keep-alive")
+        for i in $(seq 1 $n); do
+            args+=(-H "X-Header-$i: value $i")
+        done
+        out=$(curl -s -o /dev/null -o /dev/null \
+              -w "%{http_code} %{num_connects} " \
+              "${args[@]}" $URL/test-4096.bin $URL/test-4096.bin)
+        [ "$out" = "200 1 200 0 " ] || return 1
+    done
+}
+
+# Prints whether a second request reused the connection of the first, both
+# sent with the given header
+reused_with() {
+    curl -s -o /dev/null -o /dev/null -w "%{num_connects}" -H "$1" \
+        $URL/test-1.bin $URL/test-1.bin | cut -c2
+}
+
+# Header names are matched whole and in any case
+test_header_names() {
+    [ "$(reused_with "Connection: keep-alive")" = 0 ] &&
+        [ "$(reused_with "CONNECTION: Keep-Alive")" = 0 ] &&
+        [ "$(reused_with "connection: keep-alive")" = 0 ] &&
+        [ "$(reused_with "Conn: keep-alive")" = 1 ] &&
+        [ "$(reused_with "Connection-X: keep-alive")" = 1 ]
+}
+
+# Last-Modified is the modification time in GMT, and sending it back as
+# If-Modified-Since gets 304, whatever the time zone of the server
+test_not_modified() {
+    local date
+    date=$(curl -s -D - -o /dev/null $URL/test-1.bin |
+           sed -n 's/^Last-Modified: \(.*\)\r$/\1/p')
+    [ "$date" = "$(TZ=GMT LC_ALL=C date -r ${TEST_FILES}1.bin \
+                   '+%a, %d %b %Y %H:%M:%S GMT')" ] &&
+        [ "$(curl -s -o /dev/null -w "%{http_code}" \
+             -H "If-Modified-Since: $date" $URL/test-1.bin)" = 304 ]
+}
+
+# Pipelined requests are all answered, in order, whether they arrive in one
+# batch, in more requests than the output queue holds, in more bytes than
+# the read ring holds, or split across writes in the middle of a line
+test_pipelining() {
+    local i n reqs expect out
+    for i in 0 1 2 3 4; do
+        echo "body $i" > ${TEST_FILES}pipe$i.txt
+    done
+    for n in 1 5 40 200; do
+        reqs=""
+        expect=""
+        for i in $(seq 1 $n); do
+            reqs+="GET /test-pipe$((i % 5)).txt HTTP/1.1\r\n"
+            [ $i -lt $n ] && reqs+="Connection: keep-alive\r\n"
+            reqs+="Host: localhost\r\n\r\n"
+            expect+="body $((i % 5)) "
+        done
+        out=$(send_raw "$reqs" | grep -a -o "body [0-9]" | tr '\n' ' ')
+        [ "$out" = "$expect" ] || return 1
+    done
+
+    out=$(send_raw "GET /test-pi" "pe1.txt HTTP/1.1\r\nConnection: keep" \
+                   "-alive\r\n\r\nGET /test-pipe2.txt HTTP/1.1\r" \
+                   "\nHost: local" "host\r\n\r" "\n" |
+          grep -a -o "body [0-9]" | tr '\n' ' ')
+    [ "$out" = "body 1 body 2 " ]
+}
+
+# An error page is sent whole, then the connection is closed as promised
+test_error_page() {
+    local out
+    out=$(send_raw "GET /no-such-file HTTP/1.1\r\nHost: localhost\r\n\r\n") &&
+        [[ "$out" == "HTTP/1.1 404"* ]] && [[ "$out" == *"</html>"* ]]
+}
+
 pkill -9 sehttpd >/dev/null 2>/dev/null
 
 start_http_server
 test_server_local
 stop_http_server
 printf "\n"
+
+head -c $((8 << 20)) /dev/urandom > ${TEST_FILES}large.bin
+head -c $((32 << 20)) /dev/urandom > ${TEST_FILES}slow.bin
+
+start_http_server
+test_large_file; report "large file" $?
+test_concurrent_downloads; report "concurrent large files" $?
+test_slow_reader; report "slow reader" $?
+test_small_files; report "small files" $?
+test_error_page; report "error page, then close" $?
+test_many_headers; report "many headers" $?
+test_header_names; report "header names" $?
+test_not_modified; report "not modified" $?
+test_pipelining; report "pipelining" $?
+test_connection_burst; report "connection burst" $?
+test_keepalive_timeout; report "keep-alive timeout" $?
+test_cached_file; report "cached file" $?
+test_cache_invalidation; report "cache invalidation" $?
+test_open_file; report "large file kept open, then modified" $?
+test_open_file_limit; report "open file limit" $?
+stop_http_server
+
+TZ=America/New_York start_http_server
+test_not_modified; report "not modified (TZ=America/New_York)" $?
+stop_http_server
+
+start_http_server -T
+test_small_files; report "small files (-T)" $?
+test_keepalive_timeout; report "keep-alive timeout (-T)" $?
+stop_http_server
+
+start_http_server -O
+test_concurrent_downloads; report "concurrent large files (-O)" $?
+test_slow_reader; report "slow reader (-O)" $?
+test_small_files; report "small files (-O)" $?
+test_error_page; report "error page, then close (-O)" $?
+test_pipelining; report "pipelining (-O)" $?
+test_keepalive_timeout; report "keep-alive timeout (-O)" $?
+stop_http_server
+
+start_http_server -a 1
+test_connection_burst; report "connection burst (-a 1)" $?
+test_concurrent_downloads; report "concurrent large files (-a 1)" $?
+stop_http_server
+
+start_http_server -a 0
+test_connection_burst; report "connection burst (-a 0)" $?
+stop_http_server
+
+start_http_server -b io_uring
+if grep -q "falling back" $SERVER_LOG; then
+    echo "  io_uring unavailable, the following checks run on epoll"
+fi
+test_large_file; report "large file (-b io_uring)" $?
+test_concurrent_downloads; report "concurrent large files (-b io_uring)" $?
+test_slow_reader; report "slow reader (-b io_uring)" $?
+test_small_files; report "small files (-b io_uring)" $?
+test_error_page; report "error page, then close (-b io_uring)" $?
+test_many_headers; report "many headers (-b io_uring)" $?
+test_pipelining; report "pipelining (-b io_uring)" $?
+test_connection_burst; report "connection burst (-b io_uring)" $?
+test_keepalive_timeout; report "keep-alive timeout (-b io_uring)" $?
+test_cache_invalidation; report "cache invalidation (-b io_uring)" $?
+test_open_file; report "large file kept open (-b io_uring)" $?
+stop_http_server
+
+start_http_server -b io_uring -n 16
+test_request_pool; report "pools (-b io_uring -n 16)" $?
+test_aborted_download; report "aborted downloads (-b io_uring -n 16)" $?
+stop_http_server
+
+start_http_server -u
+test_large_file; report "large file (-u)" $?
+test_concurrent_downloads; report "concurrent large files (-u)" $?
+test_slow_reader; report "slow reader (-u)" $?
+test_small_files; report "small files (-u)" $?
+test_pipelining; report "pipelining (-u)" $?
+test_open_file; report "large file kept open, then modified (-u)" $?
+test_open_file_limit; report "open file limit (-u)" $?
+test_aborted_download; report "aborted downloads (-u)" $?
+stop_http_server
+
+start_http_server -b io_uring -u -m 1
+test_open_file_limit; report "open file limit (-b io_uring -u -m 1)" $?
+test_cache_eviction; report "cache eviction (-b io_uring -u -m 1)" $?
+stop_http_server
+
+start_http_server -c 4
+test_connection_limit; report "connection limit (-c 4)" $?
+test_limit_keepalive; report "keep-alive timeout at the limit (-c 4)" $?
+test_limit_spares_busy; report "busy connections kept at the limit (-c 4)" $?
+test_small_files; report "small files (-c 4)" $?
+stop_http_server
+
+start_http_server -b io_uring -c 4
+test_connection_limit; report "connection limit (-b io_uring -c 4)" $?
+test_limit_keepalive; report "keep-alive at the limit (-b io_uring -c 4)" $?
+test_limit_spares_busy; report "busy connections kept (-b io_uring -c 4)" $?
+stop_http_server
+
+start_http_server -t 4
+test_concurrent_downloads; report "concurrent large files (-t 4)" $?
+test_small_files; report "small files (-t 4)" $?
+test_cached_file; report "cached file (-t 4)" $?
+test_cache_invalidation; report "cache invalidation (-t 4)" $?
+stop_http_server
+
+start_http_server -P 2
+test_concurrent_downloads; report "concurrent large files (-P 2)" $?
+test_small_files; report "small files (-P 2)" $?
+test_worker_restart; report "worker restart (-P 2)" $?
+stop_http_server
+
+start_http_server -n 16 -H
+test_small_files; report "small files (-n 16 -H)" $?
+test_many_headers; report "many headers (-n 16 -H)" $?
+test_request_pool; report "request, buffer and header pools (-n 16 -H)" $?
+test_aborted_download; report "aborted downloads (-n 16 -H)" $?
+stop_http_server
+
+start_http_server -m 0
+test_small_files; report "small files, cache disabled (-m 0)" $?
+test_cached_file; report "rewritten file, cache disabled (-m 0)" $?
+stop_http_server
+
+start_http_server -m 1
+test_cache_eviction; report "cache eviction (-m 1)" $?
+stop_http_server
+
+[ $failures -eq 0 ]
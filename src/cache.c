@@ -0,0 +1,541 @@
+/**
+ * cache.c - In-memory cache of static files.
+ *
+ * Serving a file normally costs stat(), open(), read() or sendfile(), and
+ * close() on every request. This cache keeps the metadata of requested files
+ * so the path walk of stat() is skipped, and for the hot working set of small
+ * files it also keeps the content, together with the entity headers of its
+ * response, so a hit is answered straight from memory with one writev().
+ * Larger files keep an open descriptor, which saves open() and close() and
+ * is shared by every concurrent sendfile() of the file.
+ *
+ * Entries live in a chained hash table keyed by the resolved file name and
+ * on an LRU list. When the memory used by the cache would exceed the
+ * configured budget, the least recently used entries are evicted. Entries
+ * holding an idle descriptor are also on a second LRU list, used to close
+ * descriptors beyond CACHE_MAX_FDS.
+ *
+ * Coherency: the directories holding cached files (and their ancestors up to
+ * the web root) are watched with inotify(7). A change to a file invalidates
+ * its entry; a change to a directory itself (rename, removal) or a lost
+ * event flushes the whole cache. Without inotify, or for paths that cannot
+ * be watched reliably, every lookup revalidates the entry with stat().
+ *
+ * Limitations: changes made through a symbolic link target or a hard link
+ * living outside the watched directories are not noticed.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "logger.h"
+
+#define CACHE_BUCKETS_MIN 64
+
+/* Events that may change what a cached path refers to */
+#define WATCH_MASK                                                   \
+    (IN_ATTRIB | IN_MODIFY | IN_CREATE | IN_DELETE | IN_MOVED_FROM | \
+     IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+/**
+ * @brief A watched directory.
+ */
+typedef struct {
+    int wd;          /* inotify watch descriptor */
+    list_head files; /* Cache entries of the files directly inside */
+} watch_t;
+
+/**
+ * @brief Cache bookkeeping around the public entry.
+ */
+typedef struct {
+    cache_entry_t e;
+    bool linked;      /* Reachable from the hash table */
+    watch_t *watch;   /* Watch of the parent directory, or NULL */
+    const char *name; /* Last component of 'e.path' */
+    list_head dir;    /* Node in the parent directory's 'files' list */
+    list_head fd_lru; /* Node in 'fd_lru' while 'e.fd' is counted there */
+} node_t;
+
+/* Every event loop (worker thread) has its own cache */
+
+/* Hash table, 'nbuckets' is a power of 2 */
+static __thread cache_entry_t **buckets;
+static __thread size_t nbuckets;
+static __thread size_t nentries;
+
+static __thread size_t used;      /* Bytes held by cached entries */
+static __thread size_t budget;    /* Upper bound of 'used' */
+static __thread list_head lru;    /* Most recently used entry first */
+static __thread list_head fd_lru; /* Linked entries with an open descriptor */
+static __thread size_t nfds;      /* Number of entries on 'fd_lru' */
+
+/* Directories above 'watch_root' are not watched */
+static __thread int inotify_fd = -1;
+static __thread const char *watch_root;
+static __thread watch_t **watches;
+static __thread size_t nwatches, watches_size;
+
+/* FNV-1a hash of a file name */
+static unsigned hash_path(const char *s)
+{
+    unsigned h = 2166136261u;
+    while (*s) {
+        h ^= (unsigned char) *s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* Memory accounted to an entry */
+static inline size_t entry_cost(cache_entry_t *e)
+{
+    return sizeof(node_t) + strlen(e->path) + 1 + e->len;
+}
+
+int cache_init(size_t size)
+{
+    budget = size;
+    INIT_LIST_HEAD(&lru);
+    INIT_LIST_HEAD(&fd_lru);
+
+    nbuckets = CACHE_BUCKETS_MIN;
+    buckets = calloc(nbuckets, sizeof(cache_entry_t *));
+    if (!buckets) {
+        log_err("cache_init: calloc failed");
+        return -1;
+    }
+    return 0;
+}
+
+/* Double the hash table once it holds more entries than buckets */
+static void cache_grow()
+{
+    size_t n = nbuckets * 2;
+    cache_entry_t **b = calloc(n, sizeof(cache_entry_t *));
+    if (!b) /* keep using the smaller table */
+        return;
+
+    for (size_t i = 0; i < nbuckets; i++) {
+        cache_entry_t *e = buckets[i];
+        while (e) {
+            cache_entry_t *next = e->next;
+            e->next = b[e->hash & (n - 1)];
+            b[e->hash & (n - 1)] = e;
+            e = next;
+        }
+    }
+
+    free(buckets);
+    buckets = b;
+    nbuckets = n;
+}
+
+/* Called before the descriptor of an entry is closed */
+static __thread void (*close_hook)(cache_entry_t *e);
+
+void cache_on_close(void (*fn)(cache_entry_t *e))
+{
+    close_hook = fn;
+}
+
+/* Close the descriptor of an entry */
+static void entry_close(cache_entry_t *e)
+{
+    if (close_hook)
+        close_hook(e);
+    close(e->fd);
+    e->fd = -1;
+}
+
+/* Stop counting the descriptor of an entry against CACHE_MAX_FDS */
+static void fd_forget(node_t *node)
+{
+    if (list_empty(&node->fd_lru))
+        return;
+    list_del(&node->fd_lru);
+    INIT_LIST_HEAD(&node->fd_lru);
+    nfds--;
+}
+
+/* Remove an entry from the cache. It is freed once no response uses it. */
+static void cache_unlink(cache_entry_t *e)
+{
+    node_t *node = container_of(e, node_t, e);
+
+    cache_entry_t **pp = &buckets[e->hash & (nbuckets - 1)];
+    while (*pp != e)
+        pp = &(*pp)->next;
+    *pp = e->next;
+
+    list_del(&e->lru);
+    if (node->watch)
+        list_del(&node->dir);
+    fd_forget(node);
+    node->linked = false;
+
+    used -= entry_cost(e);
+    nentries--;
+    cache_release(e);
+}
+
+/* Evict least recently used entries until 'need' more bytes fit, but never
+ * the entry 'keep'. Returns false if that is not possible. */
+static bool cache_reserve(size_t need, cache_entry_t *keep)
+{
+    if (need > budget)
+        return false;
+
+    while (used + need > budget) {
+        assert(!list_empty(&lru) && "cache_reserve: accounting error");
+        cache_entry_t *victim = list_entry(lru.prev, cache_entry_t, lru);
+        if (victim == keep)
+            return false;
+        cache_unlink(victim);
+    }
+    return true;
+}
+
+/* Start watching a directory. Returns its watch, or NULL on failure. */
+static watch_t *watch_add(const char *path, size_t len)
+{
+    char dir[len + 1];
+    memcpy(dir, path, len);
+    dir[len] = '\0';
+
+    int wd = inotify_add_watch(inotify_fd, dir, WATCH_MASK);
+    if (wd < 0)
+        return NULL;
+
+    /* Watching a directory twice yields the same descriptor */
+    for (size_t i = 0; i < nwatches; i++) {
+        if (watches[i]->wd == wd)
+            return watches[i];
+    }
+
+    if (nwatches == watches_size) {
+        size_t n = watches_size ? watches_size * 2 : 16;
+        watch_t **w = realloc(watches, n * sizeof(watch_t *));
+        if (!w)
+            return NULL;
+        watches = w;
+        watches_size = n;
+    }
+
+    watch_t *w = malloc(sizeof(watch_t));
+    if (!w)
+        return NULL;
+    w->wd = wd;
+    INIT_LIST_HEAD(&w->files);
+    watches[nwatches++] = w;
+    return w;
+}
+
+/**
+ * @brief Watches the parent directory of 'path' and its ancestors up to the
+ * web root.
+ *
+ * @return watch_t* The watch of the parent directory, or NULL if the path
+ *         cannot be kept coherent by inotify.
+ */
+static watch_t *watch_path(const char *path)
+{
+    if (inotify_fd < 0)
+        return NULL;
+
+    size_t root_len = strlen(watch_root);
+    const char *slash = strrchr(path, '/');
+    if (!slash || strncmp(path, watch_root, root_len) || strstr(path, "/.."))
+        return NULL;
+
+    watch_t *parent = NULL;
+    for (size_t len = slash - path; len >= root_len;) {
+        watch_t *w = watch_add(path, len ? len : 1);
+        if (!w)
+            return NULL;
+        if (!parent)
+            parent = w;
+
+        /* Strip the last component */
+        while (len > 0 && path[--len] != '/')
+            ;
+        if (len == 0)
+            break;
+    }
+
+    return parent;
+}
+
+/* Drop every entry and watch, used when a change cannot be pinpointed */
+static void cache_flush()
+{
+    list_head *pos, *n;
+    list_for_each_safe (pos, n, &lru)
+        cache_unlink(list_entry(pos, cache_entry_t, lru));
+
+    for (size_t i = 0; i < nwatches; i++) {
+        inotify_rm_watch(inotify_fd, watches[i]->wd);
+        free(watches[i]);
+    }
+    nwatches = 0;
+}
+
+int cache_watch_init(const char *root)
+{
+    if (budget == 0)
+        return -1;
+
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0) {
+        log_err("inotify_init1: cached metadata is revalidated with stat()");
+        return -1;
+    }
+
+    watch_root = root;
+    return inotify_fd;
+}
+
+void cache_watch_handle()
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    for (;;) {
+        ssize_t len = read(inotify_fd, buf, sizeof(buf));
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+                log_err("cache_watch_handle: read");
+            return;
+        }
+
+        for (char *p = buf; p < buf + len;) {
+            struct inotify_event *ev = (struct inotify_event *) p;
+            p += sizeof(struct inotify_event) + ev->len;
+
+            if (ev->mask & IN_Q_OVERFLOW) { /* events were lost */
+                cache_flush();
+                continue;
+            }
+
+            watch_t *w = NULL;
+            for (size_t i = 0; i < nwatches && !w; i++) {
+                if (watches[i]->wd == ev->wd)
+                    w = watches[i];
+            }
+            if (!w) /* late event of a watch removed by cache_flush */
+                continue;
+
+            /* A directory was created, renamed or removed: paths of any
+             * cached file below it may now resolve differently. */
+            if (ev->mask & (IN_ISDIR | IN_DELETE_SELF | IN_MOVE_SELF |
+                            IN_IGNORED | IN_UNMOUNT)) {
+                cache_flush();
+                continue;
+            }
+
+            list_head *pos, *n;
+            list_for_each_safe (pos, n, &w->files) {
+                node_t *node = list_entry(pos, node_t, dir);
+                if (ev->len && !strcmp(node->name, ev->name))
+                    cache_unlink(&node->e);
+            }
+        }
+    }
+}
+
+/* Whether 'st' still describes the same version of the file as the entry */
+static bool entry_valid(cache_entry_t *e, const struct stat *st)
+{
+    return e->st.st_dev == st->st_dev && e->st.st_ino == st->st_ino &&
+           e->st.st_mode == st->st_mode && e->st.st_size == st->st_size &&
+           e->st.st_mtim.tv_sec == st->st_mtim.tv_sec &&
+           e->st.st_mtim.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/* Create an entry for 'path' and link it into the cache if it fits */
+static cache_entry_t *cache_new(const char *path,
+                                unsigned hash,
+                                const struct stat *st,
+                                watch_t *w)
+{
+    size_t path_len = strlen(path) + 1;
+    node_t *node = malloc(sizeof(node_t) + path_len);
+    if (!node) {
+        log_err("cache_new: malloc failed");
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    cache_entry_t *e = &node->e;
+    e->path = (char *) (node + 1);
+    memcpy(e->path, path, path_len);
+    e->hash = hash;
+    e->st = *st;
+    e->fd = -1;
+    e->slot = -1;
+    e->data = NULL;
+    e->len = 0;
+    e->refcnt = 1;
+    node->name = strrchr(e->path, '/') + 1;
+    node->watch = NULL;
+    node->linked = false;
+    INIT_LIST_HEAD(&node->fd_lru);
+
+    /* Cache disabled: the entry only lives for this request */
+    if (!cache_reserve(entry_cost(e), NULL))
+        return e;
+
+    if (w) {
+        node->watch = w;
+        list_add(&node->dir, &w->files);
+    }
+
+    node->linked = true;
+    e->refcnt++; /* one for the cache, one for the caller */
+    e->next = buckets[hash & (nbuckets - 1)];
+    buckets[hash & (nbuckets - 1)] = e;
+    list_add(&e->lru, &lru);
+    used += entry_cost(e);
+
+    if (++nentries > nbuckets)
+        cache_grow();
+
+    return e;
+}
+
+cache_entry_t *cache_stat(const char *path)
+{
+    unsigned h = hash_path(path);
+    struct stat st;
+
+    for (cache_entry_t *e = buckets[h & (nbuckets - 1)]; e; e = e->next) {
+        if (e->hash != h || strcmp(e->path, path))
+            continue;
+
+        /* Entries not covered by inotify are checked against the file */
+        if (!container_of(e, node_t, e)->watch) {
+            if (stat(path, &st) < 0) {
+                cache_unlink(e);
+                return NULL;
+            }
+            if (!entry_valid(e, &st)) {
+                cache_unlink(e);
+                return cache_new(path, h, &st, NULL);
+            }
+        }
+
+        /* Move to the front of the LRU list */
+        list_del(&e->lru);
+        list_add(&e->lru, &lru);
+
+        e->refcnt++;
+        return e;
+    }
+
+    /* Watch before stat(), so that a change right after it is not missed */
+    watch_t *w = watch_path(path);
+    if (stat(path, &st) < 0)
+        return NULL;
+
+    return cache_new(path, h, &st, w);
+}
+
+int cache_open(cache_entry_t *e)
+{
+    node_t *node = container_of(e, node_t, e);
+
+    if (e->fd < 0) {
+        e->fd = open(e->path, O_RDONLY | O_CLOEXEC);
+        if (e->fd < 0) {
+            log_err("cache_open: open %s", e->path);
+            return -1;
+        }
+        if (!node->linked) /* owned by this request only */
+            return e->fd;
+
+        /* Close the least recently used idle descriptors over the limit.
+         * Descriptors still used by a queued response are skipped. */
+        list_head *pos = fd_lru.prev;
+        while (nfds >= CACHE_MAX_FDS && pos != &fd_lru) {
+            node_t *victim = list_entry(pos, node_t, fd_lru);
+            pos = pos->prev;
+            if (victim->e.refcnt > 1)
+                continue;
+            entry_close(&victim->e);
+            fd_forget(victim);
+        }
+        nfds++;
+    } else if (node->linked) {
+        list_del(&node->fd_lru);
+    } else {
+        return e->fd;
+    }
+
+    list_add(&node->fd_lru, &fd_lru);
+    return e->fd;
+}
+
+int cache_fill(cache_entry_t *e, const char *hdr, size_t hdr_len)
+{
+    node_t *node = container_of(e, node_t, e);
+    size_t size = e->st.st_size;
+    size_t len = hdr_len + size;
+
+    if (e->data)
+        return 0;
+    if (!node->linked || size > CACHE_MAX_OBJECT || !cache_reserve(len, e))
+        return -1;
+
+    int fd = cache_open(e);
+    if (fd < 0)
+        return -1;
+
+    char *data = malloc(len);
+    if (!data) {
+        log_err("cache_fill: malloc failed");
+        return -1;
+    }
+    memcpy(data, hdr, hdr_len);
+
+    for (size_t done = 0; done < size;) {
+        ssize_t n = pread(fd, data + hdr_len + done, size - done, done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) { /* error, or file was truncated underneath us */
+            log_err("cache_fill: pread %s", e->path);
+            free(data);
+            return -1;
+        }
+        done += n;
+    }
+
+    /* The content is in memory now, the descriptor is no longer needed */
+    if (e->refcnt == 2) {
+        entry_close(e);
+        fd_forget(node);
+    }
+
+    e->data = data;
+    e->len = len;
+    used += len;
+    return 0;
+}
+
+void cache_release(cache_entry_t *e)
+{
+    assert(e->refcnt > 0 && "cache_release: refcnt underflow");
+    if (--e->refcnt == 0) {
+        if (e->fd >= 0)
+            entry_close(e);
+        free(e->data);
+        free(container_of(e, node_t, e));
+    }
+}
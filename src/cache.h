@@ -0,0 +1,119 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "list.h"
+
+#define CACHE_DEFAULT_SIZE (64 << 20) /* Default memory budget: 64 MiB */
+#define CACHE_MAX_OBJECT (64 << 10)   /* Larger files are sent with sendfile */
+#define CACHE_MAX_FDS 256             /* Idle file descriptors kept open */
+
+/**
+ * @brief A cached static file.
+ *
+ * Every entry holds the metadata of the file, so requests do not need to
+ * stat() it. Small files also have their content cached: 'data' holds the
+ * pre-serialized entity headers (Content-type, Content-length,
+ * Last-Modified, Server and the blank line) immediately followed by the
+ * file content, so a hit is sent straight from this buffer. Larger files
+ * keep an open descriptor instead, shared by all transfers of the file.
+ *
+ * Entries are reference counted: a response still queued on a connection
+ * keeps its entry (and descriptor) alive even after it has been evicted
+ * from the cache.
+ */
+typedef struct cache_entry {
+    char *path;                /* Resolved file name (hash key) */
+    unsigned hash;             /* Hash of 'path' */
+    struct stat st;            /* Metadata of the file */
+    int fd;                    /* Open descriptor of the file, or -1 */
+    int slot;                  /* Fixed file slot of 'fd' in io_uring, or -1 */
+
+    char *data;                /* Entity headers and body, or NULL */
+    size_t len;                /* Total length of 'data' */
+
+    int refcnt;                /* The cache itself holds one reference */
+    struct cache_entry *next;  /* Hash bucket chain */
+    list_head lru;             /* LRU list node, most recently used first */
+} cache_entry_t;
+
+/**
+ * @brief Initializes the file cache.
+ *
+ * @param budget Maximum number of bytes used by the cache, 0 disables it.
+ * @return int 0 on success, -1 on error.
+ */
+int cache_init(size_t budget);
+
+/**
+ * @brief Starts watching the web root for changes with inotify(7).
+ *
+ * Without a watcher, cached metadata is revalidated with stat() on every
+ * lookup. With it, entries are trusted until a change is reported.
+ *
+ * @param root Web root; the files below it are watched on demand.
+ * @return int The inotify descriptor to poll for EPOLLIN, or -1 if file
+ *         changes cannot be watched.
+ */
+int cache_watch_init(const char *root);
+
+/**
+ * @brief Reads pending inotify events and invalidates affected entries.
+ *
+ * Called when the descriptor returned by cache_watch_init() is readable.
+ */
+void cache_watch_handle();
+
+/**
+ * @brief Returns the cache entry of a file, stat()-ing it on a miss.
+ *
+ * @param path Resolved file name.
+ * @return cache_entry_t* Referenced entry (see cache_release), or NULL with
+ *         errno set if the file cannot be stat()-ed.
+ */
+cache_entry_t *cache_stat(const char *path);
+
+/**
+ * @brief Returns an open descriptor of the file of a cache entry.
+ *
+ * The descriptor belongs to the entry: it stays valid as long as the caller
+ * holds its reference and must not be closed by the caller. Up to
+ * CACHE_MAX_FDS idle descriptors are kept open for later requests, the
+ * least recently used ones are closed first.
+ *
+ * @param e Entry returned by cache_stat.
+ * @return int The descriptor, or -1 on error.
+ */
+int cache_open(cache_entry_t *e);
+
+/**
+ * @brief Reads the content of a small file into its cache entry.
+ *
+ * @param e Entry returned by cache_stat.
+ * @param hdr Entity headers to store in front of the body.
+ * @param hdr_len Length of 'hdr'.
+ * @return int 0 if 'e->data' is now available, -1 if the file is not
+ *         cacheable.
+ */
+int cache_fill(cache_entry_t *e, const char *hdr, size_t hdr_len);
+
+/**
+ * @brief Drops a reference obtained from cache_stat.
+ */
+void cache_release(cache_entry_t *e);
+
+/**
+ * @brief Sets a function the cache of the calling event loop calls before
+ * closing the descriptor of an entry.
+ *
+ * Every path closing a descriptor calls it: eviction from the descriptors
+ * kept open, cache_fill() and the release of the last reference. It is
+ * used to empty the fixed file slot registered for the descriptor.
+ *
+ * @param fn The function, or NULL.
+ */
+void cache_on_close(void (*fn)(cache_entry_t *e));
+
+#endif
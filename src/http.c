@@ -1,16 +1,27 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for pipe2() and SPLICE_F_MORE */
+#endif
+
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
-#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include "cache.h"
 #include "http.h"
 #include "logger.h"
 #include "timer.h"
+#include "uring.h"
 
 #define MAXLINE 8192
 #define SHORTLINE 512
@@ -20,36 +31,249 @@
 #endif
 
 /**
- * @brief Writes 'n' bytes to a descriptor.
+ * @brief Appends a segment to the output queue.
+ *
+ * @param r The request (client connection).
+ * @param data Memory to send, or NULL for a file segment.
+ * @param fd File to send when 'data' is NULL (ownership moves to the queue).
+ * @param off Offset of the first file byte to send.
+ * @param len Number of bytes to send.
+ * @return int 0 on success, -1 if the queue is full.
+ */
+static int http_out_push(http_request_t *r,
+                         const char *data,
+                         int fd,
+                         off_t off,
+                         size_t len)
+{
+    if (r->out_tail == MAX_OUT_SEGS) {
+        log_err("output queue full");
+        return -1;
+    }
+
+    /* From now on the connection waits for the client to take the response,
+     * not for its next request: it gets TIMEOUT_SEND to do so, renewed by
+     * http_out_consume() whenever some of it is sent */
+    add_timer(r, TIMEOUT_SEND, http_close_conn);
+
+    r->out[r->out_tail++] = (http_seg_t){
+        .data = data,
+        .fd = fd,
+        .off = off,
+        .len = len,
+        .cache = NULL,
+    };
+    return 0;
+}
+
+/**
+ * @brief Attaches an output buffer to the connection if it has none yet.
+ *
+ * @return int 0 on success, -1 if no buffer is available.
+ */
+static int http_out_buffer(http_request_t *r)
+{
+    if (!r->obuf && !(r->obuf = http_buffer_alloc())) {
+        log_err("http_buffer_alloc");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Queues 'len' bytes just staged at the end of the output buffer.
+ *
+ * Data staged right after a pending memory segment extends that segment, so a
+ * header built piece by piece (and a small body following it) is still
+ * written as a single chunk.
+ */
+static int http_out_commit(http_request_t *r, size_t len)
+{
+    char *p = r->obuf + r->olen;
+    r->olen += len;
+
+    if (r->out_tail > r->out_head) {
+        http_seg_t *last = &r->out[r->out_tail - 1];
+        if (last->data && last->data + last->len == p) {
+            last->len += len;
+            return 0;
+        }
+    }
+    return http_out_push(r, p, -1, 0, len);
+}
+
+/**
+ * @brief Appends formatted text to the output queue.
+ *
+ * @param r The request (client connection).
+ * @param fmt printf(3) style format string.
+ * @return int 0 on success, -1 if the output buffer or queue is full.
+ */
+static int http_out_printf(http_request_t *r, const char *fmt, ...)
+{
+    size_t room = MAX_OUT_BUF - r->olen;
+
+    if (http_out_buffer(r) != 0)
+        return -1;
+
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(r->obuf + r->olen, room, fmt, ap);
+    va_end(ap);
+
+    if (len < 0 || (size_t) len >= room) {
+        log_err("output buffer full");
+        return -1;
+    }
+    return http_out_commit(r, len);
+}
+
+/**
+ * @brief Copies 'len' bytes of a file into the output queue.
+ *
+ * Used for small bodies, which then leave in the same write as their header.
+ *
+ * @return int 0 on success, -1 on a read error or if the buffer is full.
+ */
+static int http_out_read(http_request_t *r, int fd, size_t len)
+{
+    if (len > MAX_OUT_BUF - r->olen) {
+        log_err("output buffer full");
+        return -1;
+    }
+
+    if (http_out_buffer(r) != 0)
+        return -1;
+
+    for (size_t done = 0; done < len;) {
+        ssize_t n = pread(fd, r->obuf + r->olen + done, len - done, done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) { /* error, or file was truncated underneath us */
+            log_err("pread");
+            return -1;
+        }
+        done += n;
+    }
+    return http_out_commit(r, len);
+}
+
+/**
+ * @brief Marks 'n' bytes at the head of the output queue as sent.
+ */
+static void http_out_consume(http_request_t *r, size_t n)
+{
+    /* A slow client is not cut off as long as it keeps reading */
+    if (n > 0)
+        add_timer(r, TIMEOUT_SEND, http_close_conn);
+
+    while (n > 0) {
+        http_seg_t *seg = &r->out[r->out_head];
+        size_t done = MIN(n, seg->len);
+
+        /* sendfile(2) already advanced the offset of a file segment */
+        if (seg->data)
+            seg->data += done;
+        seg->len -= done;
+        n -= done;
+
+        if (seg->len == 0) {
+            if (seg->cache)
+                cache_release(seg->cache);
+            else if (!seg->data)
+                close(seg->fd);
+            r->out_head++;
+        }
+    }
+}
+
+/**
+ * @brief Empties the output queue once everything has been sent, giving the
+ * output buffer back.
+ */
+static void http_out_reset(http_request_t *r)
+{
+    r->out_head = r->out_tail = 0;
+    r->olen = 0;
+    if (r->obuf) {
+        http_buffer_free(r->obuf);
+        r->obuf = NULL;
+    }
+}
+
+/* io_uring instance of the event loop, if it has one */
+static __thread uring_t *ring;
+
+static int http_out_splice(http_request_t *r);
+
+/**
+ * @brief Writes as much of the output queue as the socket accepts.
  *
- * Handles partial writes (common in non-blocking I/O or signals).
+ * Consecutive memory segments are gathered into one sendmsg(2) call; file
+ * segments go out with sendfile(2), so large bodies never pass through user
+ * space.
+ * The socket is non-blocking: when its send buffer is full the remaining
+ * segments stay queued, and the caller waits for EPOLLOUT to try again.
+ * When the event loop has an io_uring instance, file segments are handed to
+ * it instead (see http_out_splice()).
  *
- * @param fd File descriptor to write to.
- * @param usrbuf Buffer containing data.
- * @param n Number of bytes to write.
- * @return ssize_t Number of bytes written, or -1 on error.
+ * @param r The request (client connection).
+ * @return int 0 when the queue is empty, EAGAIN if data is still pending,
+ *         EINPROGRESS while io_uring sends a file body, or -1 on error.
  */
-static ssize_t writen(int fd, void *usrbuf, size_t n)
-{
-    ssize_t nwritten;
-    char *bufp = usrbuf;
-
-    for (size_t nleft = n; nleft > 0; nleft -= nwritten) {
-        if ((nwritten = write(fd, bufp, nleft)) <= 0) {
-            if (errno == EINTR) /* interrupted by sig handler return */
-                nwritten = 0;   /* and call write() again */
-            else {
-                log_err("errno == %d\n", errno);
-                return -1; /* errrno set by write() */
+static int http_out_flush(http_request_t *r)
+{
+    while (r->out_head < r->out_tail) {
+        http_seg_t *seg = &r->out[r->out_head];
+        ssize_t n;
+
+        /* With a ring, file bodies are spliced off the event loop */
+        if (!seg->data && ring) {
+            int rc = http_out_splice(r);
+            if (rc != 0)
+                return rc;
+            continue;
+        }
+
+        if (seg->data) {
+            struct iovec iov[MAX_OUT_SEGS];
+            int cnt = 0, i;
+            for (i = r->out_head; i < r->out_tail && r->out[i].data; i++) {
+                iov[cnt].iov_base = (void *) r->out[i].data;
+                iov[cnt++].iov_len = r->out[i].len;
+            }
+
+            /* When a file body follows, MSG_MORE holds back a partial frame
+             * (like TCP_CORK, without two extra setsockopt calls) so the
+             * header shares its TCP segment with the start of the body.
+             */
+            struct msghdr msg = {.msg_iov = iov, .msg_iovlen = cnt};
+            n = sendmsg(r->fd, &msg, i < r->out_tail ? MSG_MORE : 0);
+        } else {
+            n = sendfile(r->fd, seg->fd, &seg->off, seg->len);
+            if (n == 0) { /* file was truncated underneath us */
+                log_err("sendfile: unexpected EOF, %zu bytes left", seg->len);
+                return -1;
             }
         }
-        bufp += nwritten;
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+                return EAGAIN;
+            log_err("write response");
+            return -1;
+        }
+
+        http_out_consume(r, n);
     }
 
-    return n;
+    http_out_reset(r);
+    return 0;
 }
 
-static char *webroot = NULL;
+static __thread char *webroot = NULL;
 
 typedef struct {
     const char *type;
@@ -80,6 +304,8 @@ static mime_type_t mime[] = {{".html", "text/html"},
 static void parse_uri(char *uri, int uri_length, char *filename)
 {
     assert(uri && "parse_uri: uri is NULL");
+    /* The URI is contiguous in the mirrored read ring and followed by the
+     * space that ended it, which can be overwritten */
     uri[uri_length] = '\0';
 
     /* TODO: support query string, i.e.
@@ -119,38 +345,40 @@ static void parse_uri(char *uri, int uri_length, char *filename)
 }
 
 /**
- * @brief Sends an error response to the client.
+ * @brief Queues an error response to the client.
  *
- * @param fd Client socket.
+ * The error page announces "Connection: close", so the connection is closed
+ * once the response has been sent.
+ *
+ * @param r The request (client connection).
  * @param cause The cause of the error.
  * @param errnum HTTP error code (e.g., "404").
  * @param shortmsg Short error message.
  * @param longmsg Detailed error message.
+ * @return int 0 on success, -1 if the output queue is full.
  */
-static void do_error(int fd,
-                     char *cause,
-                     char *errnum,
-                     char *shortmsg,
-                     char *longmsg)
+static int do_error(http_request_t *r,
+                    char *cause,
+                    char *errnum,
+                    char *shortmsg,
+                    char *longmsg)
 {
-    char header[MAXLINE], body[MAXLINE];
-
-    sprintf(body,
-            "<html><title>Server Error</title>"
-            "<body>\n%s: %s\n<p>%s: %s\n</p>"
-            "<hr><em>web server</em>\n</body></html>",
-            errnum, shortmsg, longmsg, cause);
+    char body[MAXLINE];
 
-    sprintf(header,
-            "HTTP/1.1 %s %s\r\n"
-            "Server: seHTTPd\r\n"
-            "Content-type: text/html\r\n"
-            "Connection: close\r\n"
-            "Content-length: %d\r\n\r\n",
-            errnum, shortmsg, (int) strlen(body));
+    snprintf(body, sizeof(body),
+             "<html><title>Server Error</title>"
+             "<body>\n%s: %s\n<p>%s: %s\n</p>"
+             "<hr><em>web server</em>\n</body></html>",
+             errnum, shortmsg, longmsg, cause);
 
-    writen(fd, header, strlen(header));
-    writen(fd, body, strlen(body));
+    r->conn_close = true;
+    return http_out_printf(r,
+                           "HTTP/1.1 %s %s\r\n"
+                           "Server: seHTTPd\r\n"
+                           "Content-type: text/html\r\n"
+                           "Connection: close\r\n"
+                           "Content-length: %d\r\n\r\n%s",
+                           errnum, shortmsg, (int) strlen(body), body);
 }
 
 static const char *get_file_type(const char *type)
@@ -181,72 +409,121 @@ static const char *get_msg_from_status(int status_code)
 }
 
 /**
- * @brief Serves a static file to the client.
+ * @brief Formats the entity headers of a file response.
  *
- * Uses mmap to map the file into memory and then writes it to the socket.
- * This is more efficient than read/write cycle as it reduces user-kernel context switches
- * and data copying.
+ * These depend only on the file, so they are stored in the file cache along
+ * with the content.
  *
- * @param fd Client socket.
- * @param filename Path to the file.
- * @param filesize Size of the file.
- * @param out Output metadata (headers).
+ * @return int Length of the headers written to 'buf'.
  */
-static void serve_static(int fd,
-                         char *filename,
-                         size_t filesize,
-                         http_out_t *out)
+static int format_entity_header(char *buf,
+                                size_t size,
+                                const char *filename,
+                                const struct stat *st)
 {
-    char header[MAXLINE];
-    int offset = 0;
     const char *dot_pos = strrchr(filename, '.');
     const char *file_type = get_file_type(dot_pos);
+    char date[SHORTLINE];
+    struct tm tm;
 
-    offset += sprintf(header, "HTTP/1.1 %d %s\r\n", out->status,
-                      get_msg_from_status(out->status));
+    /* HTTP dates are in GMT */
+    gmtime_r(&(st->st_mtime), &tm);
+    strftime(date, SHORTLINE, "%a, %d %b %Y %H:%M:%S GMT", &tm);
 
-    if (out->keep_alive) {
-        offset += sprintf(header + offset, "Connection: keep-alive\r\n");
-        offset += sprintf(header + offset, "Keep-Alive: timeout=%d\r\n",
-                          TIMEOUT_DEFAULT);
-    }
+    return snprintf(buf, size,
+                    "Content-type: %s\r\n"
+                    "Content-length: %zu\r\n"
+                    "Last-Modified: %s\r\n"
+                    "Server: seHTTPd\r\n\r\n",
+                    file_type, (size_t) st->st_size, date);
+}
 
-    if (out->modified) {
-        char buf[SHORTLINE];
-        offset += sprintf(header + offset, "Content-type: %s\r\n", file_type);
-        offset += sprintf(header + offset, "Content-length: %zu\r\n", filesize);
-        struct tm tm;
-        localtime_r(&(out->mtime), &tm);
-        strftime(buf, SHORTLINE, "%a, %d %b %Y %H:%M:%S GMT", &tm);
-        offset += sprintf(header + offset, "Last-Modified: %s\r\n", buf);
+/**
+ * @brief Queues the entity headers and body held by a cache entry.
+ *
+ * The queue references the entry's memory directly and drops the reference
+ * once it has been sent.
+ */
+static int http_out_cached(http_request_t *r, cache_entry_t *e)
+{
+    if (http_out_push(r, e->data, -1, 0, e->len) != 0) {
+        cache_release(e);
+        return -1;
     }
+    r->out[r->out_tail - 1].cache = e;
+    return 0;
+}
 
-    sprintf(header + offset, "Server: seHTTPd\r\n\r\n");
+/**
+ * @brief Queues a static file response for the client.
+ *
+ * The status line is staged in the output buffer. If the content of the
+ * file is cached, the rest of the response is sent from the cache without
+ * touching the file system. Otherwise the file is cached when it is small
+ * enough; if not, a small body is copied behind its header so both leave in
+ * a single write, and a larger body is queued as a file segment, to be
+ * transmitted with sendfile(2) by http_out_flush() from the descriptor kept
+ * open by the cache.
+ *
+ * @param r The request (client connection).
+ * @param e Cache entry of the file; the reference is consumed.
+ * @param out Output metadata (headers).
+ * @return int 0 on success, or -1 on error.
+ */
+static int serve_static(http_request_t *r, cache_entry_t *e, http_out_t *out)
+{
+    size_t filesize = e->st.st_size;
+    int rc = 0;
 
-    size_t n = (size_t) writen(fd, header, strlen(header));
-    assert(n == strlen(header) && "writen error");
-    if (n != strlen(header)) {
-        log_err("n != strlen(header)");
-        return;
+    rc |= http_out_printf(r, "HTTP/1.1 %d %s\r\n", out->status,
+                          get_msg_from_status(out->status));
+
+    /* No Keep-Alive header: its timeout is in seconds, while connections
+     * idle for less than one are closed, and sooner near the -c limit */
+    if (out->keep_alive)
+        rc |= http_out_printf(r, "Connection: keep-alive\r\n");
+
+    /* 304 Not Modified: no entity headers and no body */
+    if (!out->modified || rc != 0) {
+        cache_release(e);
+        return rc | http_out_printf(r, "Server: seHTTPd\r\n\r\n");
     }
 
-    if (!out->modified)
-        return;
+    if (e->data)
+        return http_out_cached(r, e);
 
-    int srcfd = open(filename, O_RDONLY, 0);
-    assert(srcfd > 2 && "open error");
-    /* TODO: use sendfile(2) for zero-copy support */
-    /* mmap maps the file content to a memory address.
-     * PROT_READ: Pages may be read.
-     * MAP_PRIVATE: Create a private copy-on-write mapping.
-     */
-    char *srcaddr = mmap(NULL, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);
-    assert(srcaddr != (void *) -1 && "mmap error");
-    close(srcfd);
+    char hdr[SHORTLINE];
+    int hdr_len = format_entity_header(hdr, sizeof(hdr), e->path, &e->st);
+
+    if (cache_fill(e, hdr, hdr_len) == 0)
+        return http_out_cached(r, e);
 
-    writen(fd, srcaddr, filesize);
+    rc = http_out_printf(r, "%s", hdr);
+    if (rc != 0 || filesize == 0) {
+        cache_release(e);
+        return rc;
+    }
+
+    /* The descriptor is owned by the cache entry */
+    int srcfd = cache_open(e);
+    if (srcfd < 0) {
+        cache_release(e);
+        return -1;
+    }
 
-    munmap(srcaddr, filesize);
+    if (filesize <= MAX_INLINE_BODY) {
+        rc = http_out_read(r, srcfd, filesize);
+        cache_release(e);
+        return rc;
+    }
+
+    /* The file segment keeps the entry, and so the descriptor, alive */
+    if (http_out_push(r, NULL, srcfd, 0, filesize) != 0) {
+        cache_release(e);
+        return -1;
+    }
+    r->out[r->out_tail - 1].cache = e;
+    return 0;
 }
 
 static inline int init_http_out(http_out_t *o, int fd)
@@ -258,11 +535,173 @@ static inline int init_http_out(http_out_t *o, int fd)
     return 0;
 }
 
+/**
+ * @brief Tells whether the output queue surely has room for one more
+ * response.
+ *
+ * A response takes at most two segments (headers, and the body when it is
+ * not copied behind them) and, in the output buffer, its headers and at most
+ * MAX_INLINE_BODY bytes of body or an error page.
+ */
+static inline bool http_out_has_room(const http_request_t *r)
+{
+    return r->out_tail + 2 <= MAX_OUT_SEGS &&
+           r->olen + MAX_INLINE_BODY + 2 * SHORTLINE <= MAX_OUT_BUF;
+}
+
+/**
+ * @brief Parses the request in the read ring, resuming where the previous
+ * call stopped.
+ *
+ * @return int 0 once the whole request is parsed, EAGAIN if more data is
+ *         needed, or a parser error.
+ */
+static int http_parse_request(http_request_t *r)
+{
+    int rc;
+
+    /* Request line (GET /path HTTP/1.1) */
+    if (!r->line_done) {
+        rc = http_parse_request_line(r);
+        if (rc != 0)
+            return rc;
+        r->line_done = true;
+
+        debug("uri = %.*s", (int) (r->uri_end - r->uri_start),
+              (char *) r->uri_start);
+    }
+
+    /* Headers */
+    rc = http_parse_request_body(r);
+    if (rc != 0)
+        return rc;
+
+    r->line_done = false;
+    r->request_end = NULL;
+    return 0;
+}
+
+/**
+ * @brief Queues the response to a parsed request.
+ *
+ * @return int 0 on success, or -1 on error.
+ */
+static int http_serve_request(http_request_t *r)
+{
+    char filename[SHORTLINE];
+    http_out_t out;
+    init_http_out(&out, r->fd);
+
+    parse_uri(r->uri_start, r->uri_end - r->uri_start, filename);
+
+    /* Metadata comes from the file cache, saving a stat() per request */
+    cache_entry_t *e = cache_stat(filename);
+    if (!e)
+        return do_error(r, filename, "404", "Not Found", "Can't find the file");
+
+    if (!(S_ISREG(e->st.st_mode)) || !(S_IRUSR & e->st.st_mode)) {
+        cache_release(e);
+        return do_error(r, filename, "403", "Forbidden", "Can't read the file");
+    }
+
+    out.mtime = e->st.st_mtime;
+
+    http_handle_header(r, &out);
+    assert(list_empty(&(r->list)) && "header list should be empty");
+
+    if (!out.status)
+        out.status = HTTP_OK;
+
+    if (!out.keep_alive)
+        r->conn_close = true;
+
+    return serve_static(r, e, &out);
+}
+
+/**
+ * @brief Serves the complete requests received so far, while their
+ * responses fit in the output queue.
+ *
+ * @return int 0 on success, or -1 on error.
+ */
+static int http_serve_received(http_request_t *r)
+{
+    while (r->buf && r->pos < r->last && !r->conn_close &&
+           http_out_has_room(r)) {
+        int rc = http_parse_request(r);
+        if (rc == EAGAIN) /* Incomplete request, continue reading */
+            break;
+        if (rc != 0) {
+            log_err("malformed request, rc = %d", rc);
+            return -1;
+        }
+
+        if (http_serve_request(r) != 0)
+            return -1;
+
+        /* The next request starts at 'pos'; move it back to the first view
+         * of the ring */
+        r->start = r->pos % MAX_BUF;
+        r->last = r->start + (r->last - r->pos);
+        r->pos = r->start;
+    }
+    return 0;
+}
+
+/**
+ * @brief Attaches a read ring to the connection while a request is coming
+ * in, and header records along with it.
+ *
+ * @return int 0 on success, -1 if no ring is available.
+ */
+static int http_ring_attach(http_request_t *r)
+{
+    if (!r->buf && !(r->buf = http_ring_alloc())) {
+        log_err("http_ring_alloc");
+        return -1;
+    }
+
+    /* Without header records, headers are malloc()-ed */
+    if (!r->headers)
+        r->headers = http_headers_alloc();
+    return 0;
+}
+
+/**
+ * @brief Detaches the read ring and header records once everything
+ * received has been handled, while the connection waits for its next
+ * request.
+ */
+static void http_ring_detach(http_request_t *r)
+{
+    if (!r->buf || r->pos != r->last || r->state != 0 || r->line_done ||
+        !list_empty(&(r->list)))
+        return;
+
+    http_ring_free(r->buf);
+    r->buf = NULL;
+    if (r->headers) {
+        http_headers_free(r->headers);
+        r->headers = NULL;
+    }
+    r->start = r->pos = r->last = 0;
+}
+
 /**
  * @brief Core request handling logic.
  *
- * Called when the client socket is ready to be read (EPOLLIN).
- * It reads data from the socket, parses the request, and sends a response.
+ * Called when the client socket is ready to be read (EPOLLIN), or ready to be
+ * written (EPOLLOUT). Unless connections are re-armed with EPOLLONESHOT, the
+ * latter is also reported when no response is pending; the pass then only
+ * finds nothing to send or read.
+ *
+ * Every complete request already received is served before reading again:
+ * with HTTP pipelining, a client may send many requests back to back. Their
+ * responses are queued behind each other and flushed together, so a batch
+ * of small responses leaves in a single sendmsg(2). When the output queue
+ * has no room left, the responses queued so far are flushed first; if the
+ * socket cannot take them, the remaining requests wait in the read ring
+ * until EPOLLOUT.
  *
  * @param ptr Pointer to http_request_t structure.
  */
@@ -271,20 +710,55 @@ void do_request(void *ptr)
     http_request_t *r = ptr;
     int fd = r->fd;
     int rc;
-    char filename[SHORTLINE];
+    uint32_t wait_event = EPOLLIN;
     webroot = r->root;
 
-    /* Remove existing timer while processing the request */
-    del_timer(r);
+    /* Closed while io_uring was still sending a file body */
+    if (r->closing)
+        return;
+
+    /* The output queue is in use by io_uring: serving more requests now
+     * could move the buffered headers it sends from. Data received in the
+     * meantime is read once io_uring is done. */
+    if (r->sending)
+        goto wait_uring;
+
     for (;;) {
-        /* Calculate available space in the ring buffer */
-        char *plast = &r->buf[r->last % MAX_BUF];
-        size_t remain_size =
-            MIN(MAX_BUF - (r->last - r->pos) - 1, MAX_BUF - r->last % MAX_BUF);
+        /* Serve the requests received so far while their responses fit */
+        if (http_serve_received(r) != 0)
+            goto err;
+
+        /* Send the queued responses in one batch */
+        rc = http_out_flush(r);
+        if (rc == EAGAIN) /* Socket send buffer full, wait for EPOLLOUT */
+            goto wait_writable;
+        if (rc == EINPROGRESS) /* Called again once io_uring is done */
+            goto wait_uring;
+        if (rc != 0)
+            goto err;
+
+        if (r->conn_close) {
+            debug("no keep_alive! ready to close");
+            goto close;
+        }
+
+        /* Requests left over for lack of room in the queue come first */
+        if (r->buf && r->pos < r->last)
+            continue;
+
+        /* A read ring is only attached while a request is coming in */
+        if (http_ring_attach(r) != 0)
+            goto err;
+
+        /* The ring is mirrored, so all of its free space follows the data.
+         * Bytes of the current request before 'pos' stay in place: parsed
+         * headers point to them. */
+        char *plast = &r->buf[r->last];
+        size_t remain_size = MAX_BUF - (r->last - r->start) - 1;
 
         /* Read data from the socket */
         int n = read(fd, plast, remain_size);
-        assert(r->last - r->pos < MAX_BUF && "request buffer overflow!");
+        assert(r->last - r->start < MAX_BUF && "request buffer overflow!");
 
         if (n == 0) /* EOF: Client closed connection */
             goto err;
@@ -300,85 +774,542 @@ void do_request(void *ptr)
         }
 
         r->last += n;
-        assert(r->last - r->pos < MAX_BUF && "request buffer overflow!");
+        assert(r->last - r->start < MAX_BUF && "request buffer overflow!");
+    }
 
-        /* Try to parse the request line (GET /path HTTP/1.1) */
-        rc = http_parse_request_line(r);
-        if (rc == EAGAIN) /* Incomplete request line, continue reading */
-            continue;
-        if (rc != 0) {
-            log_err("rc != 0");
-            goto err;
-        }
+    http_ring_detach(r);
+    goto rearm;
 
-        debug("uri = %.*s", (int) (r->uri_end - r->uri_start),
-              (char *) r->uri_start);
+wait_writable:
+    /* The socket send buffer is full. Wait until the client drains it and
+     * continue sending the queued response from where it stopped. The send
+     * timer keeps running: only progress renews it, not this event.
+     */
+    wait_event = EPOLLOUT;
 
-        /* Try to parse headers */
-        rc = http_parse_request_body(r);
-        if (rc == EAGAIN) /* Incomplete headers, continue reading */
-            continue;
-        if (rc != 0) {
-            log_err("rc != 0");
-            goto err;
-        }
+rearm:
+    /* With EPOLLONESHOT, the event is disabled until re-armed here. Without
+     * it, the connection stays registered for both directions: the next
+     * edge on either one brings us back, and since every pass sends and
+     * reads until EAGAIN, no edge can be missed. That saves a syscall per
+     * request.
+     */
+    if (http_conn_oneshot())
+        epoll_ctl(r->epfd, EPOLL_CTL_MOD, r->fd,
+                  &(struct epoll_event){
+                      .data.ptr = ptr,
+                      .events = wait_event | EPOLLET | EPOLLONESHOT,
+                  });
+
+    /* Once everything is sent, reset the keep-alive timer. The timer stayed
+     * armed while the request was processed: expired timers only run once
+     * the events are handled, and postponing an armed timer is cheaper than
+     * deleting and adding it. */
+    if (wait_event == EPOLLIN)
+        add_timer(r, TIMEOUT_DEFAULT, http_close_conn);
+    return;
+
+wait_uring:
+    /* The connection needs no event until io_uring has sent the pipe-full
+     * of the file body it is sending, and is not re-armed. The send timer
+     * runs meanwhile. */
+    return;
+
+err:
+close:
+    /* TODO: handle the timeout raised by inactive connections */
+    rc = http_close_conn(r);
+    assert(rc == 0 && "do_request: http_close_conn");
+}
 
-        /* Handle http header processing and prepare response */
-        http_out_t *out = malloc(sizeof(http_out_t));
-        if (!out) {
-            log_err("no enough space for http_out_t");
-            exit(1);
+/* Receive buffers of the io_uring event loop: a receive request takes one
+ * only once data has arrived, and gives it back as soon as the data is
+ * copied into the read ring of the connection. */
+#define URING_RX_BUFS 256
+#define URING_RX_BUF_SIZE 4096
+
+/* Bytes of a file body moved through the pipe of a connection at a time.
+ * Pipes are enlarged to this size, the default limit of unprivileged users,
+ * so that large bodies take few round trips through io_uring. */
+#define URING_PIPE_CHUNK (1 << 20)
+
+/* Longest chain of output requests: one per segment, two for a file */
+#define URING_MAX_CHAIN (MAX_OUT_SEGS + 1)
+
+/* Fixed file slots for the descriptors of files in the cache */
+#define URING_FIXED_FILES (2 * CACHE_MAX_FDS)
+
+static __thread uring_bufs_t rx_bufs;
+static __thread int *free_slots; /* Stack of free fixed file slots */
+static __thread int nfree_slots;
+static __thread cache_entry_t **slot_owner; /* Entry in each slot, or NULL */
+static __thread int uring_efd = -1; /* Completion eventfd (epoll loop) */
+
+/**
+ * @brief Empties the fixed file slot of a cache entry whose descriptor is
+ * being closed.
+ */
+static void http_uring_drop_file(cache_entry_t *e)
+{
+    if (e->slot < 0)
+        return;
+
+    uring_update_file(ring, e->slot, -1);
+    slot_owner[e->slot] = NULL;
+    free_slots[nfree_slots++] = e->slot;
+    e->slot = -1;
+}
+
+/**
+ * @brief Returns the fixed file slot of the file of a segment, registering
+ * the file on its first use if a slot is free.
+ *
+ * Hot files are spliced through their slot, which spares the kernel looking
+ * up and referencing the descriptor on every request. Files are only
+ * registered while another reference to their entry than the one of the
+ * segment exists, usually the one of the cache, as others are about to be
+ * closed. The slot does not keep the descriptor open: the cache closes it
+ * when the entry is evicted, filled or released, and every one of these
+ * paths empties the slot first through http_uring_drop_file(), the close
+ * hook of the cache. Requests already submitted keep the file they were
+ * submitted with.
+ *
+ * @return int The slot, or -1 to use the descriptor itself.
+ */
+static int http_uring_file_slot(const http_seg_t *seg)
+{
+    cache_entry_t *e = seg->cache;
+    if (!e || !free_slots || e->refcnt < 2)
+        return -1;
+
+    if (e->slot < 0 && nfree_slots > 0 &&
+        uring_update_file(ring, free_slots[nfree_slots - 1], e->fd) == 0) {
+        e->slot = free_slots[--nfree_slots];
+        slot_owner[e->slot] = e;
+    }
+    return e->slot;
+}
+
+/**
+ * @brief Sets up the fixed file table of the ring. Without it, files are
+ * spliced through their descriptor.
+ */
+static void http_uring_files_setup()
+{
+    if (uring_register_files(ring, URING_FIXED_FILES) < 0 ||
+        !(free_slots = malloc(URING_FIXED_FILES * sizeof(int))) ||
+        !(slot_owner = calloc(URING_FIXED_FILES, sizeof(cache_entry_t *)))) {
+        log_err("Failed to register fixed files");
+        free(free_slots);
+        free_slots = NULL;
+        return;
+    }
+
+    for (int i = 0; i < URING_FIXED_FILES; i++)
+        free_slots[i] = URING_FIXED_FILES - 1 - i;
+    nfree_slots = URING_FIXED_FILES;
+    cache_on_close(http_uring_drop_file);
+}
+
+int http_uring_init(uring_t *u)
+{
+    if (uring_bufs_init(u, &rx_bufs, 0, URING_RX_BUFS, URING_RX_BUF_SIZE) < 0)
+        return -1;
+    ring = u;
+    http_uring_files_setup();
+    return 0;
+}
+
+int http_uring_files_init(uring_t *u)
+{
+    int efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (efd < 0)
+        return -1;
+
+    if (uring_register_eventfd(u, efd) < 0) {
+        close(efd);
+        return -1;
+    }
+
+    ring = u;
+    http_uring_files_setup();
+    uring_efd = efd;
+    return efd;
+}
+
+void http_uring_exit()
+{
+    if (!ring)
+        return;
+
+    /* Entries of the cache outlive the ring, and must not keep its slots */
+    if (free_slots) {
+        cache_on_close(NULL);
+        for (int i = 0; i < URING_FIXED_FILES; i++) {
+            if (slot_owner[i])
+                slot_owner[i]->slot = -1;
         }
+        free(free_slots);
+        free(slot_owner);
+        free_slots = NULL;
+        slot_owner = NULL;
+        nfree_slots = 0;
+    }
+
+    if (rx_bufs.br) {
+        uring_bufs_exit(&rx_bufs);
+        memset(&rx_bufs, 0, sizeof(rx_bufs));
+    }
+
+    if (uring_efd >= 0) {
+        close(uring_efd);
+        uring_efd = -1;
+    }
+    ring = NULL;
+}
+
+/**
+ * @brief Takes a submission queue entry for a request of a connection.
+ *
+ * The request is linked to the next one (IOSQE_IO_LINK), so a chain of
+ * requests runs in order; the caller unlinks the last request of a chain.
+ */
+static struct io_uring_sqe *http_uring_sqe(http_request_t *r, int op)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (!sqe)
+        return NULL;
+
+    sqe->fd = r->fd;
+    sqe->user_data = uring_data(r, op);
+    r->inflight++;
+    if (op != HTTP_URING_RECV) {
+        sqe->flags = IOSQE_IO_LINK;
+        r->sending++;
+    }
+    return sqe;
+}
+
+/**
+ * @brief Queues the output queue for sending as one chain of requests.
+ *
+ * Memory segments are sent with MSG_WAITALL, so a request that comes short
+ * fails and cancels the rest of the chain rather than letting later data
+ * overtake it. A file body is spliced into the pipe of the connection and
+ * from there to the socket, without passing through user space; it is sent
+ * one pipe-full per chain, and the chain ends with it. A chain that finds
+ * the pipe still holding data polls the socket, then sends that data.
+ *
+ * @return int 0 on success, or -1 on error.
+ */
+static int http_uring_send(http_request_t *r)
+{
+    struct io_uring_sqe *sqe = NULL;
 
-        init_http_out(out, fd);
+    if (uring_reserve(ring, URING_MAX_CHAIN) < 0)
+        return -1;
 
-        parse_uri(r->uri_start, r->uri_end - r->uri_start, filename);
+    for (int i = r->out_head; i < r->out_tail; i++) {
+        http_seg_t *seg = &r->out[i];
+        bool more = i + 1 < r->out_tail;
 
-        struct stat sbuf;
-        if (stat(filename, &sbuf) < 0) {
-            do_error(fd, filename, "404", "Not Found", "Can't find the file");
+        if (seg->data) {
+            if (!(sqe = http_uring_sqe(r, HTTP_URING_SEND)))
+                return -1;
+            sqe->opcode = IORING_OP_SEND;
+            sqe->addr = (uintptr_t) seg->data;
+            sqe->len = seg->len;
+            sqe->msg_flags = MSG_WAITALL | (more ? MSG_MORE : 0);
             continue;
         }
 
-        if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
-            do_error(fd, filename, "403", "Forbidden", "Can't read the file");
-            continue;
+        if (r->pipefd[0] < 0) {
+            if (pipe2(r->pipefd, O_CLOEXEC) < 0) {
+                log_err("pipe2");
+                return -1;
+            }
+            /* Users over their quota of pipe memory keep smaller pipes */
+            int size = fcntl(r->pipefd[1], F_SETPIPE_SZ, URING_PIPE_CHUNK);
+            if (size < 0 && (size = fcntl(r->pipefd[1], F_GETPIPE_SZ)) < 0) {
+                log_err("F_GETPIPE_SZ");
+                return -1;
+            }
+            r->pipe_size = size;
+        }
+
+        /* What the socket left in the pipe is sent before more of the body
+         * goes in: the pipe might not have room for it, and a splice into
+         * a full pipe would wait for a reader queued after it. The socket
+         * took less than offered, so it is polled until writable first. */
+        size_t chunk = r->piped ? 0 : MIN(seg->len, r->pipe_size);
+        if (!chunk) {
+            if (!(sqe = http_uring_sqe(r, HTTP_URING_POLL_OUT)))
+                return -1;
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->poll32_events = POLLOUT;
+        } else {
+            if (!(sqe = http_uring_sqe(r, HTTP_URING_SPLICE_IN)))
+                return -1;
+            int slot = http_uring_file_slot(seg);
+            sqe->opcode = IORING_OP_SPLICE;
+            sqe->splice_fd_in = slot >= 0 ? slot : seg->fd;
+            sqe->splice_off_in = seg->off;
+            if (slot >= 0)
+                sqe->splice_flags = SPLICE_F_FD_IN_FIXED;
+            sqe->fd = r->pipefd[1];
+            sqe->off = (uint64_t) -1;
+            sqe->len = chunk;
         }
 
-        out->mtime = sbuf.st_mtime;
+        if (!(sqe = http_uring_sqe(r, HTTP_URING_SPLICE_OUT)))
+            return -1;
+        sqe->opcode = IORING_OP_SPLICE;
+        sqe->splice_fd_in = r->pipefd[0];
+        sqe->splice_off_in = (uint64_t) -1;
+        sqe->off = (uint64_t) -1;
+        sqe->len = r->piped + chunk;
+        if (more || seg->len > r->piped + chunk)
+            sqe->splice_flags = SPLICE_F_MORE;
+        break;
+    }
 
-        http_handle_header(r, out);
-        assert(list_empty(&(r->list)) && "header list should be empty");
+    if (sqe)
+        sqe->flags &= ~IOSQE_IO_LINK;
+    return 0;
+}
 
-        if (!out->status)
-            out->status = HTTP_OK;
+/**
+ * @brief Queues a receive request for the connection.
+ *
+ * At most as much as the read ring has room for is received.
+ *
+ * @return int 0 on success, or -1 on error.
+ */
+static int http_uring_recv(http_request_t *r)
+{
+    size_t room = MAX_BUF - 1 - (r->buf ? r->last - r->start : 0);
+    if (room == 0) {
+        log_err("request too large");
+        return -1;
+    }
 
-        serve_static(fd, filename, sbuf.st_size, out);
+    struct io_uring_sqe *sqe = http_uring_sqe(r, HTTP_URING_RECV);
+    if (!sqe)
+        return -1;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->len = MIN(room, URING_RX_BUF_SIZE);
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = rx_bufs.bgid;
+    r->receiving = true;
+    return 0;
+}
 
-        if (!out->keep_alive) {
+/**
+ * @brief Moves the connection forward after some of its requests completed.
+ *
+ * Like one pass of do_request(): the requests received are served, the
+ * responses are sent once the previous output batch is done, and receiving
+ * resumes once every complete request has been served.
+ *
+ * @return int 0 on success, or -1 if the connection is to be closed.
+ */
+static int http_uring_process(http_request_t *r)
+{
+    webroot = r->root;
+
+    /* Once a batch is sent, its room in the output queue is free again */
+    if (!r->sending && r->out_head == r->out_tail)
+        http_out_reset(r);
+
+    if (http_serve_received(r) != 0)
+        return -1;
+
+    if (!r->sending) {
+        if (r->out_err)
+            return -1;
+        if (r->out_head < r->out_tail) {
+            if (http_uring_send(r) != 0)
+                return -1;
+        } else if (r->conn_close) {
             debug("no keep_alive! ready to close");
-            free(out);
-            goto close;
+            return -1;
         }
-        free(out);
     }
 
-    /* Re-arm the epoll event.
-     * We used EPOLLONESHOT, so we must manually re-enable the event.
-     */
-    struct epoll_event event = {
-        .data.ptr = ptr,
-        .events = EPOLLIN | EPOLLET | EPOLLONESHOT,
-    };
-    epoll_ctl(r->epfd, EPOLL_CTL_MOD, r->fd, &event);
+    /* Requests left over for lack of room in the output queue, or after the
+     * last one, are not followed by more data */
+    if (r->receiving || r->conn_close || (r->buf && r->pos < r->last))
+        return 0;
 
-    /* Reset the timeout timer */
+    http_ring_detach(r);
+    return http_uring_recv(r);
+}
+
+int http_uring_open(http_request_t *r)
+{
     add_timer(r, TIMEOUT_DEFAULT, http_close_conn);
-    return;
+    if (http_uring_process(r) != 0) {
+        http_close_conn(r);
+        return -1;
+    }
+    return 0;
+}
 
-err:
-close:
-    /* TODO: handle the timeout raised by inactive connections */
-    rc = http_close_conn(r);
-    assert(rc == 0 && "do_request: http_close_conn");
+/**
+ * @brief Accounts for the completion of a request of a connection.
+ *
+ * @return int 0 if the connection goes on, -1 if it has been closed.
+ */
+static int http_uring_done(http_request_t *r, int op, int res, unsigned flags)
+{
+    r->inflight--;
+    if (op == HTTP_URING_RECV)
+        r->receiving = false;
+    else
+        r->sending--;
+
+    if (r->closing) {
+        if (flags & IORING_CQE_F_BUFFER)
+            uring_buf_recycle(&rx_bufs, flags);
+        if (!r->inflight)
+            http_close_conn(r);
+        return -1;
+    }
+
+    switch (op) {
+    case HTTP_URING_RECV:
+        if (res == -ENOBUFS) /* Every buffer in use, try again */
+            break;
+        if (res <= 0) { /* EOF: Client closed connection, or error */
+            if (res < 0)
+                log_err("recv err, res = %d", res);
+            http_close_conn(r);
+            return -1;
+        }
+
+        if (http_ring_attach(r) != 0) {
+            uring_buf_recycle(&rx_bufs, flags);
+            http_close_conn(r);
+            return -1;
+        }
+        memcpy(&r->buf[r->last], uring_buf(&rx_bufs, flags), res);
+        uring_buf_recycle(&rx_bufs, flags);
+        r->last += res;
+        assert(r->last - r->start < MAX_BUF && "request buffer overflow!");
+        break;
+
+    case HTTP_URING_SEND:
+    case HTTP_URING_SPLICE_OUT:
+        /* Requests cancelled by the failure of an earlier one in the chain
+         * are queued again with the next batch. Sockets are non-blocking and
+         * may not take a whole pipe-full; what is left in the pipe is sent
+         * by http_out_flush() in the epoll event loop, by the next chain in
+         * the io_uring one. */
+        if (res > 0) {
+            if (op == HTTP_URING_SPLICE_OUT)
+                r->piped -= res;
+            http_out_consume(r, res);
+        } else if (res != -ECANCELED && res != -EAGAIN) {
+            log_err("write response, res = %d", res);
+            r->out_err = true;
+        }
+        break;
+
+    case HTTP_URING_POLL_OUT:
+        if (res < 0 && res != -ECANCELED) {
+            log_err("poll socket, res = %d", res);
+            r->out_err = true;
+        }
+        break;
+
+    case HTTP_URING_SPLICE_IN:
+        if (res > 0) {
+            assert(!r->out[r->out_head].data && "file segment expected");
+            r->out[r->out_head].off += res;
+            r->piped += res;
+        } else if (res != -ECANCELED) { /* file truncated, or error */
+            log_err("splice file, res = %d", res);
+            r->out_err = true;
+        }
+        break;
+    }
+
+    return 0;
+}
+
+void http_uring_complete(http_request_t *r, int op, int res, unsigned flags)
+{
+    if (http_uring_done(r, op, res, flags) != 0)
+        return;
+
+    if (http_uring_process(r) != 0) {
+        http_close_conn(r);
+        return;
+    }
+
+    /* Reset the keep-alive timer once everything is sent, as do_request()
+     * does. Until then the send timer runs, renewed by every send or splice
+     * that makes progress, so a completion without any does not keep a
+     * stalled client around. */
+    if (!r->sending && r->out_head == r->out_tail)
+        add_timer(r, TIMEOUT_DEFAULT, http_close_conn);
+}
+
+/**
+ * @brief Sends what the pipe holds, or has the next pipe-full of the file
+ * body at the head of the output queue spliced by io_uring.
+ *
+ * This is how the epoll event loop sends file bodies when it has a ring.
+ * Data left in the pipe because the socket was full is sent right away
+ * rather than by io_uring, so that a full socket is waited for with
+ * EPOLLOUT.
+ *
+ * @return int 0 if data was sent, EAGAIN if the socket is full, EINPROGRESS
+ *         while io_uring is sending, or -1 on error.
+ */
+static int http_out_splice(http_request_t *r)
+{
+    if (r->sending)
+        return EINPROGRESS;
+
+    if (r->piped) {
+        ssize_t n = splice(r->pipefd[0], NULL, r->fd, NULL, r->piped,
+                           SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+        if (n < 0) {
+            if (errno == EAGAIN)
+                return EAGAIN;
+            log_err("splice");
+            return -1;
+        }
+        r->piped -= n;
+        http_out_consume(r, n);
+        return 0;
+    }
+
+    return http_uring_send(r) == 0 ? EINPROGRESS : -1;
+}
+
+void http_uring_files_handle()
+{
+    uint64_t count;
+    if (read(uring_efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        log_err("read eventfd");
+
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_peek(ring))) {
+        http_request_t *r = uring_ptr(cqe->user_data);
+        int op = uring_op(cqe->user_data);
+        int res = cqe->res;
+        unsigned flags = cqe->flags;
+        uring_advance(ring);
+
+        if (http_uring_done(r, op, res, flags) != 0 || r->sending)
+            continue;
+
+        /* The pipe-full is sent, carry on with the output queue */
+        if (r->out_err)
+            http_close_conn(r);
+        else
+            do_request(r);
+    }
 }
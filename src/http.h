@@ -3,9 +3,14 @@
 
 #include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
 #include <time.h>
 
 #include "list.h"
+#include "timer.h"
+#include "uring.h"
 
 /**
  * Return codes for the HTTP parser.
@@ -36,24 +41,64 @@ enum http_status {
     HTTP_NOT_FOUND = 404,
 };
 
-#define MAX_BUF 8124
+#define MAX_BUF 8192     /* Read ring size, a multiple of the page size */
+#define MAX_OUT_BUF 8192 /* Staging area for headers, error pages, small bodies */
+#define MAX_INLINE_BODY 4096 /* Bodies up to this size are copied into obuf */
+#define MAX_OUT_SEGS 16  /* Maximum number of queued response segments */
+#define MAX_HEADERS 32   /* Headers of a request stored without malloc() */
+
+struct cache_entry;
+
+/**
+ * @brief A piece of a response waiting in the output queue.
+ *
+ * A memory segment ('data' != NULL) points into the connection's output
+ * buffer, or into a file cache entry it holds a reference to. A file segment
+ * is transmitted with sendfile(2); 'fd' belongs to the referenced cache
+ * entry, or to the segment itself if there is none.
+ */
+typedef struct {
+    const char *data;   /* Next byte of a memory segment, NULL for a file */
+    int fd;             /* File descriptor of a file segment, -1 for memory */
+    off_t off;          /* Offset of the next file byte to send */
+    size_t len;         /* Number of bytes still to send */
+    struct cache_entry *cache; /* Cache entry 'data' or 'fd' belongs to */
+} http_seg_t;
+
+/**
+ * @brief Represents a single HTTP header (Key: Value).
+ */
+typedef struct {
+    void *key_start, *key_end;     /* Pointers to Key string in request buffer */
+    void *value_start, *value_end; /* Pointers to Value string in request buffer */
+    list_head list;                /* Linked list node */
+} http_header_t;
 
 /**
  * @brief Represents an active HTTP client connection.
  *
  * This structure holds the state of the connection, including the file descriptors,
  * the read buffer, parsing state, and pointers to parsed data.
+ *
+ * The read and output buffers are only attached while they are in use: an
+ * idle keep-alive connection holds neither. What it still holds is the
+ * parser state and the output segment array, which stays inline.
  */
-typedef struct {
+typedef struct http_request {
     void *root;         /* Web root directory */
     int fd;             /* Client socket file descriptor */
     int epfd;           /* Epoll file descriptor (to modify events) */
 
-    char buf[MAX_BUF];  /* Ring buffer for reading requests */
+    /* Ring buffer for reading requests, or NULL. The ring is mapped twice in
+     * a row: a request starts in the first view and may run on into the
+     * second, so its bytes are always contiguous at buf[start..last). */
+    char *buf;
+    size_t start;       /* Start of the request being received, < MAX_BUF */
     size_t pos;         /* Current parsing position in buf */
     size_t last;        /* End of data position in buf */
 
     int state;          /* Current state of the parser FSM */
+    bool line_done;     /* Request line parsed, headers are being parsed */
 
     /* Pointers into 'buf' marking parts of the request.
      * This avoids copying strings (zero-copy parsing). */
@@ -67,13 +112,38 @@ typedef struct {
 
     struct list_head list; /* Linked list to store parsed HTTP headers */
 
+    /* Records of parsed headers, attached along with 'buf', or NULL. Headers
+     * beyond the first MAX_HEADERS of a request are malloc()-ed instead. */
+    http_header_t *headers;
+    int nheaders;          /* Records of 'headers' in use */
+
     /* Pointers for the current header being parsed */
     void *cur_header_key_start;
     void *cur_header_key_end;
     void *cur_header_value_start;
     void *cur_header_value_end;
 
-    void *timer;        /* Pointer to the timer node for this connection */
+    timer_node timer;   /* Idle timeout of this connection */
+
+    /* Output queue. Responses are queued as segments and written without
+     * blocking; whatever the socket cannot take yet stays queued and is
+     * resumed on the next EPOLLOUT notification. */
+    char *obuf;                   /* Storage for memory segments, or NULL */
+    size_t olen;                  /* Bytes used in obuf */
+    http_seg_t out[MAX_OUT_SEGS]; /* Pending segments, in sending order */
+    int out_head, out_tail;       /* Pending range is out[out_head..out_tail) */
+    bool conn_close;              /* Close once the output queue drains */
+
+    /* io_uring event loop only. The requests of a connection refer to it
+     * until they complete, so it is only released after the last one. */
+    int inflight;       /* Requests submitted and not completed yet */
+    int sending;        /* Requests of the output batch in flight */
+    bool receiving;     /* A receive request is in flight */
+    bool out_err;       /* A request of the output batch failed */
+    bool closing;       /* Closed, released once 'inflight' drops to zero */
+    int pipefd[2];      /* Pipe splicing file bodies to the socket, or -1 */
+    unsigned pipe_size; /* Capacity of the pipe */
+    unsigned piped;     /* Bytes of the head file segment in the pipe */
 } http_request_t;
 
 /**
@@ -87,15 +157,6 @@ typedef struct {
     int status;         /* HTTP status code (200, 404, etc.) */
 } http_out_t;
 
-/**
- * @brief Represents a single HTTP header (Key: Value).
- */
-typedef struct {
-    void *key_start, *key_end;     /* Pointers to Key string in request buffer */
-    void *value_start, *value_end; /* Pointers to Value string in request buffer */
-    list_head list;                /* Linked list node */
-} http_header_t;
-
 /**
  * @brief Function pointer type for handling specific HTTP headers.
  */
@@ -112,9 +173,170 @@ typedef struct {
     http_header_handler handler;
 } http_header_handle_t;
 
+/**
+ * @brief Takes a record for a parsed header.
+ *
+ * @return http_header_t* The next free record of the request, or a malloc()-ed
+ *         one if they are all used, or NULL on error.
+ */
+static inline http_header_t *http_header_alloc(http_request_t *r)
+{
+    if (r->headers && r->nheaders < MAX_HEADERS)
+        return &r->headers[r->nheaders++];
+    return malloc(sizeof(http_header_t));
+}
+
+/**
+ * @brief Releases a header record unlinked from the list of a request.
+ *
+ * Records of the request's array are not released one by one: they are all
+ * reused once the whole list has been processed and 'nheaders' is reset.
+ */
+static inline void http_header_free(http_request_t *r, http_header_t *hd)
+{
+    if (!r->headers || hd < r->headers || hd >= r->headers + MAX_HEADERS)
+        free(hd);
+}
+
 void http_handle_header(http_request_t *r, http_out_t *o);
+
+/**
+ * @brief Builds the table http_handle_header() looks header names up in.
+ *
+ * Called once at startup, before any worker starts.
+ */
+void http_header_init();
 int http_close_conn(http_request_t *r);
 
+/**
+ * @brief Sets up the pools of request structures and I/O buffers of the
+ * calling event loop.
+ *
+ * @param prealloc Number of structures and buffers to preallocate.
+ * @param huge Back the pools with huge pages. Read rings, which are memory
+ *        files mapped twice, always use regular pages.
+ * @return int 0 on success, -1 on error.
+ */
+int http_request_pool_init(size_t prealloc, bool huge);
+
+/**
+ * @brief Allocates a request structure from the pool of the calling event
+ * loop. It is returned to the pool by http_close_conn().
+ *
+ * @return http_request_t* Uninitialized structure, or NULL on error.
+ */
+http_request_t *http_request_alloc();
+
+/**
+ * @brief Sets up the request structure of a new client connection.
+ *
+ * The connection counts towards the limit of the calling event loop until
+ * it is closed with http_close_conn().
+ *
+ * @param fd Client socket descriptor.
+ * @param epfd Epoll descriptor.
+ * @param root Web root path.
+ * @return http_request_t* The request, or NULL on error.
+ */
+http_request_t *http_open_conn(int fd, int epfd, char *root);
+
+/**
+ * @brief Limits the number of client connections of the calling event loop.
+ *
+ * Past half the limit, the keep-alive timeout shrinks as connections are
+ * opened, down to TIMEOUT_MIN at the limit.
+ *
+ * @param limit Maximum number of connections, 0 for no limit.
+ */
+void http_conn_set_limit(int limit);
+
+/**
+ * @brief Chooses how the calling event loop registers client connections.
+ *
+ * By default a connection is registered once for EPOLLIN, EPOLLOUT and
+ * EPOLLRDHUP, edge-triggered, and never modified again. With 'oneshot', it
+ * is registered with EPOLLONESHOT and re-armed after each event, which an
+ * event loop sharing its epoll set between threads would need.
+ *
+ * @param oneshot Register connections with EPOLLONESHOT.
+ */
+void http_conn_set_oneshot(bool oneshot);
+
+/**
+ * @brief Tells whether the calling event loop re-arms connections with
+ * EPOLLONESHOT.
+ */
+bool http_conn_oneshot();
+
+/**
+ * @brief Returns the epoll events to register a new client connection with.
+ */
+uint32_t http_conn_events();
+
+/**
+ * @brief Tells whether the calling event loop has as many connections open
+ * as its limit allows.
+ */
+bool http_conn_at_limit();
+
+/**
+ * @brief Tells whether a connection waits for a request, with no response
+ * queued or being sent, so that closing it loses nothing.
+ */
+bool http_conn_idle(http_request_t *r);
+
+/**
+ * @brief Returns the keep-alive timeout (ms) for the current connection count.
+ *
+ * Idle connections arm their timer with TIMEOUT_DEFAULT; the event loop
+ * closes them early when this is shorter.
+ */
+size_t http_keepalive_timeout();
+
+/**
+ * @brief Takes an output buffer of MAX_OUT_BUF bytes from the pool of the
+ * calling event loop.
+ *
+ * @return char* The buffer, or NULL on error.
+ */
+char *http_buffer_alloc();
+
+/**
+ * @brief Returns an output buffer to its pool.
+ */
+void http_buffer_free(char *buf);
+
+/**
+ * @brief Takes a read ring of MAX_BUF bytes, mapped twice in a row, from the
+ * pool of the calling event loop.
+ *
+ * @return char* The ring, or NULL on error.
+ */
+char *http_ring_alloc();
+
+/**
+ * @brief Returns a read ring to its pool.
+ */
+void http_ring_free(char *buf);
+
+/**
+ * @brief Takes an array of MAX_HEADERS header records from the pool of the
+ * calling event loop.
+ *
+ * @return http_header_t* The array, or NULL on error.
+ */
+http_header_t *http_headers_alloc();
+
+/**
+ * @brief Returns an array of header records to its pool.
+ */
+void http_headers_free(http_header_t *headers);
+
+/**
+ * @brief Prints the occupancy of the pools of the calling event loop.
+ */
+void http_report_pools();
+
 /**
  * @brief Initializes an http_request_t structure.
  *
@@ -129,15 +351,112 @@ static inline void init_http_request(http_request_t *r,
                                      char *root)
 {
     r->fd = fd, r->epfd = epfd;
-    r->pos = r->last = 0;
+    r->buf = NULL;
+    r->start = r->pos = r->last = 0;
     r->state = 0;
+    r->line_done = false;
+    r->request_end = NULL;
     r->root = root;
+    r->obuf = NULL;
+    r->olen = 0;
+    r->out_head = r->out_tail = 0;
+    r->conn_close = false;
+    r->inflight = r->sending = 0;
+    r->receiving = r->out_err = r->closing = false;
+    r->pipefd[0] = r->pipefd[1] = -1;
+    r->piped = 0;
+    r->pipe_size = 0;
     INIT_LIST_HEAD(&(r->list));
+    r->headers = NULL;
+    r->nheaders = 0;
+    timer_node_init(&r->timer);
 }
 
 /* TODO: public functions should have conventions to prefix http_ */
 void do_request(void *infd);
 
+/**
+ * Kinds of io_uring requests, stored in the low bits of their 'user_data'
+ * along with the object they belong to (see uring_data()).
+ */
+enum http_uring_op {
+    HTTP_URING_ACCEPT,     /* Multishot accept on a listening socket */
+    HTTP_URING_POLL,       /* Multishot poll of a timerfd or inotify fd */
+    HTTP_URING_RECV,       /* Receive into a provided buffer */
+    HTTP_URING_SEND,       /* Send of a memory segment */
+    HTTP_URING_SPLICE_IN,  /* Splice of a file segment into the pipe */
+    HTTP_URING_SPLICE_OUT, /* Splice from the pipe to the socket */
+    HTTP_URING_POLL_OUT,   /* Wait for room in the socket to splice to */
+};
+
+/**
+ * @brief Serves the connections of the calling event loop through 'ring'.
+ *
+ * Sets up the ring of buffers receive requests pick from, and fixed file
+ * slots for the files the cache keeps open.
+ *
+ * @return int 0 on success, -1 if the kernel does not support it.
+ */
+int http_uring_init(uring_t *ring);
+
+/**
+ * @brief Lets the epoll event loop hand file bodies to 'ring'.
+ *
+ * Instead of sendfile(2), a file body is then spliced from the file to a
+ * pipe and on to the socket by linked io_uring requests, one pipe-full at a
+ * time, so reading the file never blocks the event loop. Cached files are
+ * registered as fixed files.
+ *
+ * @return int An eventfd signaled on completions, to poll for EPOLLIN, or
+ *         -1 on error.
+ */
+int http_uring_files_init(uring_t *ring);
+
+/**
+ * @brief Stops using the ring set up by http_uring_init() or
+ * http_uring_files_init(), before the event loop tears it down.
+ *
+ * Releases the buffers and fixed file slots tied to the ring, so an event
+ * loop that cannot run on io_uring can fall back to another one.
+ */
+void http_uring_exit();
+
+/**
+ * @brief Handles the completions of the ring set up with
+ * http_uring_files_init().
+ *
+ * Called when the eventfd it returned is readable; connections whose file
+ * body made progress carry on with do_request().
+ */
+void http_uring_files_handle();
+
+/**
+ * @brief Starts serving a connection accepted by the io_uring event loop.
+ *
+ * @return int 0 on success, or -1 if the connection has been closed.
+ */
+int http_uring_open(http_request_t *r);
+
+/**
+ * @brief Handles the completion of a request of a connection.
+ *
+ * This is the io_uring counterpart of do_request(): data received is
+ * parsed and answered, and further output and receive requests are queued.
+ *
+ * @param r The connection.
+ * @param op The kind of request (enum http_uring_op).
+ * @param res Result of the request.
+ * @param flags Flags of the completion.
+ */
+void http_uring_complete(http_request_t *r, int op, int res, unsigned flags);
+
+/**
+ * @brief Selects the fastest delimiter scanning the CPU supports.
+ *
+ * Must be called once before any request is parsed.
+ */
+void http_parser_init();
+
 int http_parse_request_line(http_request_t *r);
 int http_parse_request_body(http_request_t *r);
 
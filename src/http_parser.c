@@ -12,13 +12,25 @@
  * An FSM processes one character at a time and transitions between states.
  * If we run out of data, we simply return EAGAIN and save the current state.
  * When more data arrives, we resume exactly where we left off.
+ *
+ * States are labels and transitions are direct jumps; a parser re-enters its
+ * saved state through a table of label addresses (computed goto).
+ *
+ * Most bytes of a request belong to the URI and to header keys and values,
+ * where the FSM only waits for a delimiter. In those states the parser skips
+ * ahead to the next delimiter with SIMD instructions (AVX2 or SSE4.2, picked
+ * at startup from what the CPU supports) and resumes byte-wise from there.
  */
 
 #include <assert.h>
 #include <stdint.h>
 #include <stdlib.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #include "http.h"
+#include "logger.h"
 
 /* Constant-time string comparison macro.
  *
@@ -38,6 +50,128 @@
 #define LF '\n'
 #define CRLFCRLF "\r\n\r\n"
 
+/**
+ * @brief Finds the first occurrence of 'a' or 'b' in 'p[0..len)'.
+ *
+ * @return size_t Its offset, or 'len' if there is none.
+ */
+typedef size_t (*scan_fn)(const uint8_t *p, size_t len, uint8_t a, uint8_t b);
+
+static size_t scan_scalar(const uint8_t *p, size_t len, uint8_t a, uint8_t b)
+{
+    size_t i;
+    for (i = 0; i < len; i++) {
+        if (p[i] == a || p[i] == b)
+            break;
+    }
+    return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse4.2"))) static size_t scan_sse42(const uint8_t *p,
+                                                           size_t len,
+                                                           uint8_t a,
+                                                           uint8_t b)
+{
+    const __m128i set = _mm_setr_epi8(a, b, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                      0, 0, 0);
+    size_t i = 0;
+
+    /* Whole 16-byte blocks only, so nothing past 'len' is ever read */
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (p + i));
+        int idx = _mm_cmpestri(set, 2, v, 16,
+                               _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY |
+                                   _SIDD_LEAST_SIGNIFICANT);
+        if (idx < 16)
+            return i + idx;
+    }
+    return i + scan_scalar(p + i, len - i, a, b);
+}
+
+__attribute__((target("avx2"))) static size_t scan_avx2(const uint8_t *p,
+                                                        size_t len,
+                                                        uint8_t a,
+                                                        uint8_t b)
+{
+    const __m256i va = _mm256_set1_epi8(a), vb = _mm256_set1_epi8(b);
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (p + i));
+        __m256i eq = _mm256_or_si256(_mm256_cmpeq_epi8(v, va),
+                                     _mm256_cmpeq_epi8(v, vb));
+        uint32_t mask = _mm256_movemask_epi8(eq);
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return i + scan_scalar(p + i, len - i, a, b);
+}
+#endif
+
+/* Set once by http_parser_init(), before any worker starts */
+static scan_fn scan = scan_scalar;
+
+void http_parser_init()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scan = scan_avx2;
+        debug("parser: AVX2 scanning");
+        return;
+    }
+    if (__builtin_cpu_supports("sse4.2")) {
+        scan = scan_sse42;
+        debug("parser: SSE4.2 scanning");
+        return;
+    }
+#endif
+    debug("parser: scalar scanning");
+}
+
+/**
+ * @brief Skips the bytes after 'p' up to the next 'a' or 'b', or to the end
+ * of the received data.
+ *
+ * @return uint8_t* The last byte skipped ('p' if none), so the next iteration
+ *         of the FSM reads the delimiter.
+ */
+static inline uint8_t *skip_to(uint8_t *p,
+                               const uint8_t *end,
+                               uint8_t a,
+                               uint8_t b)
+{
+    return p + scan(p + 1, end - p - 1, a, b);
+}
+
+/* Computed goto dispatch.
+ *
+ * Each state of a parser is a label. A parser enters at the label of its
+ * saved state through a table of label addresses ("labels as values", a GNU
+ * C extension), then moves between states with direct jumps: no switch is
+ * evaluated per byte, and states that consume runs of ordinary characters
+ * loop on their own.
+ *
+ * NEXT_BYTE(s) advances to the next byte. At the end of the received data it
+ * saves 's' as the state to resume from and returns EAGAIN.
+ * GOTO(s) advances and continues in the state 's' (label 's', state s_##s).
+ */
+#define NEXT_BYTE(s)          \
+    do {                      \
+        if (++p == end) {     \
+            state = (s);      \
+            goto again;       \
+        }                     \
+        ch = *p;              \
+    } while (0)
+
+#define GOTO(s)            \
+    do {                   \
+        NEXT_BYTE(s_##s);  \
+        goto s;            \
+    } while (0)
+
 /**
  * @brief Parses the HTTP Request Line (e.g., "GET /index.html HTTP/1.1").
  *
@@ -46,8 +180,7 @@
  */
 int http_parse_request_line(http_request_t *r)
 {
-    uint8_t ch, *p, *m;
-    size_t pi;
+    uint8_t ch, *p, *m, *end;
 
     enum {
         s_start = 0,
@@ -67,232 +200,206 @@ int http_parse_request_line(http_request_t *r)
         s_almost_done
     } state;
 
-    /* Resume from saved state */
+    static const void *const dispatch[] = {
+        [s_start] = &&start,
+        [s_method] = &&method,
+        [s_spaces_before_uri] = &&spaces_before_uri,
+        [s_after_slash_in_uri] = &&after_slash_in_uri,
+        [s_http] = &&http,
+        [s_http_H] = &&http_H,
+        [s_http_HT] = &&http_HT,
+        [s_http_HTT] = &&http_HTT,
+        [s_http_HTTP] = &&http_HTTP,
+        [s_first_major_digit] = &&first_major_digit,
+        [s_major_digit] = &&major_digit,
+        [s_first_minor_digit] = &&first_minor_digit,
+        [s_minor_digit] = &&minor_digit,
+        [s_spaces_after_digit] = &&spaces_after_digit,
+        [s_almost_done] = &&almost_done,
+    };
+
+    /* Nothing new to parse */
+    if (r->pos >= r->last)
+        return EAGAIN;
+
+    /* Resume from saved state. The ring is mirrored, so the request is
+     * contiguous even where it wraps around. */
     state = r->state;
+    p = (uint8_t *) &r->buf[r->pos];
+    end = p + (r->last - r->pos);
+    ch = *p;
+    goto *dispatch[state];
 
-    /* Iterate over the available data in the ring buffer */
-    for (pi = r->pos; pi < r->last; pi++) {
-        p = (uint8_t *) &r->buf[pi % MAX_BUF];
-        ch = *p;
-
-        /* TODO: use computed goto for efficient dispatching */
-        switch (state) {
-        /* HTTP methods: GET, HEAD, POST */
-        case s_start:
-            r->request_start = p;
+/* HTTP methods: GET, HEAD, POST */
+start:
+    r->request_start = p;
 
-            if (ch == CR || ch == LF) /* Skip empty lines */
-                break;
+    if (ch == CR || ch == LF) /* Skip empty lines */
+        GOTO(start);
 
-            if ((ch < 'A' || ch > 'Z') && ch != '_')
-                return HTTP_PARSER_INVALID_METHOD;
+    if ((ch < 'A' || ch > 'Z') && ch != '_')
+        return HTTP_PARSER_INVALID_METHOD;
 
-            state = s_method;
-            break;
-
-        case s_method:
-            if (ch == ' ') { /* Space after method */
-                m = r->request_start;
-
-                /* Optimization: Check method length and use fast compare */
-                switch (p - m) {
-                case 3:
-                    if (cst_strcmp(m, 'G', 'E', 'T', ' ')) {
-                        r->method = HTTP_GET;
-                        break;
-                    }
-                    break;
-
-                case 4:
-                    if (cst_strcmp(m, 'P', 'O', 'S', 'T')) {
-                        r->method = HTTP_POST;
-                        break;
-                    }
-
-                    if (cst_strcmp(m, 'H', 'E', 'A', 'D')) {
-                        r->method = HTTP_HEAD;
-                        break;
-                    }
-                    break;
-
-                default:
-                    r->method = HTTP_UNKNOWN;
-                    break;
-                }
-                state = s_spaces_before_uri;
-                break;
-            }
-
-            if ((ch < 'A' || ch > 'Z') && ch != '_')
-                return HTTP_PARSER_INVALID_METHOD;
-            break;
+    GOTO(method);
 
-        /* space* before URI */
-        case s_spaces_before_uri:
-            if (ch == '/') {
-                r->uri_start = p;
-                state = s_after_slash_in_uri;
-                break;
-            }
-
-            switch (ch) {
-            case ' ':
-                break;
-            default:
-                return HTTP_PARSER_INVALID_REQUEST;
-            }
-            break;
+method:
+    while (ch != ' ') {
+        if ((ch < 'A' || ch > 'Z') && ch != '_')
+            return HTTP_PARSER_INVALID_METHOD;
+        NEXT_BYTE(s_method);
+    }
 
-        case s_after_slash_in_uri:
-            switch (ch) {
-            case ' ':
-                r->uri_end = p;
-                state = s_http;
-                break;
-            default:
-                break;
-            }
-            break;
+    /* Space after method */
+    m = r->request_start;
 
-        /* space+ after URI. Expecting "HTTP/..." */
-        case s_http:
-            switch (ch) {
-            case ' ':
-                break;
-            case 'H':
-                state = s_http_H;
-                break;
-            default:
-                return HTTP_PARSER_INVALID_REQUEST;
-            }
+    /* Optimization: Check method length and use fast compare */
+    switch (p - m) {
+    case 3:
+        if (cst_strcmp(m, 'G', 'E', 'T', ' ')) {
+            r->method = HTTP_GET;
             break;
+        }
+        break;
 
-        case s_http_H:
-            switch (ch) {
-            case 'T':
-                state = s_http_HT;
-                break;
-            default:
-                return HTTP_PARSER_INVALID_REQUEST;
-            }
+    case 4:
+        if (cst_strcmp(m, 'P', 'O', 'S', 'T')) {
+            r->method = HTTP_POST;
             break;
+        }
 
-        case s_http_HT:
-            switch (ch) {
-            case 'T':
-                state = s_http_HTT;
-                break;
-            default:
-                return HTTP_PARSER_INVALID_REQUEST;
-            }
+        if (cst_strcmp(m, 'H', 'E', 'A', 'D')) {
+            r->method = HTTP_HEAD;
             break;
+        }
+        break;
 
-        case s_http_HTT:
-            switch (ch) {
-            case 'P':
-                state = s_http_HTTP;
-                break;
-            default:
-                return HTTP_PARSER_INVALID_REQUEST;
-            }
-            break;
+    default:
+        r->method = HTTP_UNKNOWN;
+        break;
+    }
+    GOTO(spaces_before_uri);
 
-        case s_http_HTTP:
-            switch (ch) {
-            case '/':
-                state = s_first_major_digit;
-                break;
-            default:
-                return HTTP_PARSER_INVALID_REQUEST;
-            }
-            break;
+/* space* before URI */
+spaces_before_uri:
+    while (ch == ' ')
+        NEXT_BYTE(s_spaces_before_uri);
 
-        /* first digit of major HTTP version */
-        case s_first_major_digit:
-            if (ch < '1' || ch > '9')
-                return HTTP_PARSER_INVALID_REQUEST;
+    if (ch != '/')
+        return HTTP_PARSER_INVALID_REQUEST;
 
-            r->http_major = ch - '0';
-            state = s_major_digit;
-            break;
+    r->uri_start = p;
+    GOTO(after_slash_in_uri);
 
-        /* major HTTP version or dot */
-        case s_major_digit:
-            if (ch == '.') {
-                state = s_first_minor_digit;
-                break;
-            }
+after_slash_in_uri:
+    while (ch != ' ') {
+        p = skip_to(p, end, ' ', ' ');
+        NEXT_BYTE(s_after_slash_in_uri);
+    }
 
-            if (ch < '0' || ch > '9')
-                return HTTP_PARSER_INVALID_REQUEST;
+    r->uri_end = p;
+    GOTO(http);
+
+/* space+ after URI. Expecting "HTTP/..." */
+http:
+    while (ch == ' ')
+        NEXT_BYTE(s_http);
+
+    if (ch != 'H')
+        return HTTP_PARSER_INVALID_REQUEST;
+    GOTO(http_H);
+
+http_H:
+    if (ch != 'T')
+        return HTTP_PARSER_INVALID_REQUEST;
+    GOTO(http_HT);
+
+http_HT:
+    if (ch != 'T')
+        return HTTP_PARSER_INVALID_REQUEST;
+    GOTO(http_HTT);
+
+http_HTT:
+    if (ch != 'P')
+        return HTTP_PARSER_INVALID_REQUEST;
+    GOTO(http_HTTP);
+
+http_HTTP:
+    if (ch != '/')
+        return HTTP_PARSER_INVALID_REQUEST;
+    GOTO(first_major_digit);
+
+/* first digit of major HTTP version */
+first_major_digit:
+    if (ch < '1' || ch > '9')
+        return HTTP_PARSER_INVALID_REQUEST;
+
+    r->http_major = ch - '0';
+    GOTO(major_digit);
+
+/* major HTTP version or dot */
+major_digit:
+    while (ch != '.') {
+        if (ch < '0' || ch > '9')
+            return HTTP_PARSER_INVALID_REQUEST;
+
+        r->http_major = r->http_major * 10 + ch - '0';
+        NEXT_BYTE(s_major_digit);
+    }
+    GOTO(first_minor_digit);
 
-            r->http_major = r->http_major * 10 + ch - '0';
-            break;
+/* first digit of minor HTTP version */
+first_minor_digit:
+    if (ch < '0' || ch > '9')
+        return HTTP_PARSER_INVALID_REQUEST;
 
-        /* first digit of minor HTTP version */
-        case s_first_minor_digit:
-            if (ch < '0' || ch > '9')
-                return HTTP_PARSER_INVALID_REQUEST;
+    r->http_minor = ch - '0';
+    GOTO(minor_digit);
 
-            r->http_minor = ch - '0';
-            state = s_minor_digit;
-            break;
+/* minor HTTP version or end of request line */
+minor_digit:
+    for (;;) {
+        if (ch == CR)
+            GOTO(almost_done);
 
-        /* minor HTTP version or end of request line */
-        case s_minor_digit:
-            if (ch == CR) {
-                state = s_almost_done;
-                break;
-            }
+        if (ch == LF)
+            goto done;
 
-            if (ch == LF)
-                goto done;
+        if (ch == ' ')
+            GOTO(spaces_after_digit);
 
-            if (ch == ' ') {
-                state = s_spaces_after_digit;
-                break;
-            }
+        if (ch < '0' || ch > '9')
+            return HTTP_PARSER_INVALID_REQUEST;
 
-            if (ch < '0' || ch > '9')
-                return HTTP_PARSER_INVALID_REQUEST;
+        r->http_minor = r->http_minor * 10 + ch - '0';
+        NEXT_BYTE(s_minor_digit);
+    }
 
-            r->http_minor = r->http_minor * 10 + ch - '0';
-            break;
+spaces_after_digit:
+    while (ch == ' ')
+        NEXT_BYTE(s_spaces_after_digit);
 
-        case s_spaces_after_digit:
-            switch (ch) {
-            case ' ':
-                break;
-            case CR:
-                state = s_almost_done;
-                break;
-            case LF:
-                goto done;
-            default:
-                return HTTP_PARSER_INVALID_REQUEST;
-            }
-            break;
+    if (ch == CR)
+        GOTO(almost_done);
+    if (ch == LF)
+        goto done;
+    return HTTP_PARSER_INVALID_REQUEST;
 
-        /* end of request line */
-        case s_almost_done:
-            r->request_end = p - 1;
-            switch (ch) {
-            case LF:
-                goto done;
-            default:
-                return HTTP_PARSER_INVALID_REQUEST;
-            }
-        }
-    }
+/* end of request line */
+almost_done:
+    r->request_end = p - 1;
+    if (ch == LF)
+        goto done;
+    return HTTP_PARSER_INVALID_REQUEST;
 
+again:
     /* Run out of data, save state and return EAGAIN */
-    r->pos = pi;
+    r->pos = r->last;
     r->state = state;
 
     return EAGAIN;
 
 done:
-    r->pos = pi + 1;
+    r->pos = r->last - (end - p) + 1;
 
     if (!r->request_end)
         r->request_end = p;
@@ -310,8 +417,7 @@ done:
  */
 int http_parse_request_body(http_request_t *r)
 {
-    uint8_t ch, *p;
-    size_t pi;
+    uint8_t ch, *p, *end;
 
     enum {
         s_start = 0,
@@ -324,108 +430,108 @@ int http_parse_request_body(http_request_t *r)
         s_crlfcr
     } state;
 
-    state = r->state;
-    assert(state == 0 && "state should be 0");
+    static const void *const dispatch[] = {
+        [s_start] = &&start,
+        [s_key] = &&key,
+        [s_spaces_before_colon] = &&spaces_before_colon,
+        [s_spaces_after_colon] = &&spaces_after_colon,
+        [s_value] = &&value,
+        [s_cr] = &&cr,
+        [s_crlf] = &&crlf,
+        [s_crlfcr] = &&crlfcr,
+    };
 
     http_header_t *hd;
-    for (pi = r->pos; pi < r->last; pi++) {
-        p = (uint8_t *) &r->buf[pi % MAX_BUF];
-        ch = *p;
 
-        switch (state) {
-        case s_start:
-            if (ch == CR || ch == LF)
-                break;
+    if (r->pos >= r->last)
+        return EAGAIN;
 
-            r->cur_header_key_start = p;
-            state = s_key;
-            break;
+    state = r->state;
+    p = (uint8_t *) &r->buf[r->pos];
+    end = p + (r->last - r->pos);
+    ch = *p;
+    goto *dispatch[state];
+
+start:
+    while (ch == CR || ch == LF)
+        NEXT_BYTE(s_start);
+
+    r->cur_header_key_start = p;
+    GOTO(key);
+
+key:
+    while (ch != ' ' && ch != ':') {
+        p = skip_to(p, end, ' ', ':');
+        NEXT_BYTE(s_key);
+    }
 
-        case s_key:
-            if (ch == ' ') {
-                r->cur_header_key_end = p;
-                state = s_spaces_before_colon;
-                break;
-            }
-
-            if (ch == ':') {
-                r->cur_header_key_end = p;
-                state = s_spaces_after_colon;
-                break;
-            }
-            break;
+    r->cur_header_key_end = p;
+    if (ch == ' ')
+        GOTO(spaces_before_colon);
+    GOTO(spaces_after_colon);
 
-        case s_spaces_before_colon:
-            if (ch == ' ')
-                break;
-            if (ch == ':') {
-                state = s_spaces_after_colon;
-                break;
-            }
-            return HTTP_PARSER_INVALID_HEADER;
-
-        case s_spaces_after_colon:
-            if (ch == ' ')
-                break;
-
-            state = s_value;
-            r->cur_header_value_start = p;
-            break;
+spaces_before_colon:
+    while (ch == ' ')
+        NEXT_BYTE(s_spaces_before_colon);
 
-        case s_value:
-            if (ch == CR) {
-                r->cur_header_value_end = p;
-                state = s_cr;
-            }
+    if (ch != ':')
+        return HTTP_PARSER_INVALID_HEADER;
+    GOTO(spaces_after_colon);
 
-            if (ch == LF) {
-                r->cur_header_value_end = p;
-                state = s_crlf;
-            }
-            break;
+spaces_after_colon:
+    while (ch == ' ')
+        NEXT_BYTE(s_spaces_after_colon);
 
-        case s_cr:
-            if (ch == LF) {
-                state = s_crlf;
-                /* save the current HTTP header */
-                hd = malloc(sizeof(http_header_t));
-                hd->key_start = r->cur_header_key_start;
-                hd->key_end = r->cur_header_key_end;
-                hd->value_start = r->cur_header_value_start;
-                hd->value_end = r->cur_header_value_end;
-
-                list_add(&(hd->list), &(r->list));
-                break;
-            }
-            return HTTP_PARSER_INVALID_HEADER;
-
-        case s_crlf:
-            if (ch == CR) {
-                state = s_crlfcr;
-            } else {
-                r->cur_header_key_start = p;
-                state = s_key;
-            }
-            break;
+    r->cur_header_value_start = p;
+    GOTO(value);
 
-        case s_crlfcr:
-            switch (ch) {
-            case LF:
-                goto done;
-            default:
-                return HTTP_PARSER_INVALID_HEADER;
-            }
-            break;
-        }
+value:
+    while (ch != CR && ch != LF) {
+        p = skip_to(p, end, CR, LF);
+        NEXT_BYTE(s_value);
     }
 
-    r->pos = pi;
+    r->cur_header_value_end = p;
+    if (ch == LF)
+        GOTO(crlf);
+    GOTO(cr);
+
+cr:
+    if (ch != LF)
+        return HTTP_PARSER_INVALID_HEADER;
+
+    /* save the current HTTP header */
+    hd = http_header_alloc(r);
+    if (!hd)
+        return HTTP_PARSER_INVALID_HEADER;
+    hd->key_start = r->cur_header_key_start;
+    hd->key_end = r->cur_header_key_end;
+    hd->value_start = r->cur_header_value_start;
+    hd->value_end = r->cur_header_value_end;
+
+    list_add(&(hd->list), &(r->list));
+    GOTO(crlf);
+
+crlf:
+    if (ch == CR)
+        GOTO(crlfcr);
+
+    r->cur_header_key_start = p;
+    GOTO(key);
+
+crlfcr:
+    if (ch == LF)
+        goto done;
+    return HTTP_PARSER_INVALID_HEADER;
+
+again:
+    r->pos = r->last;
     r->state = state;
 
     return EAGAIN;
 
 done:
-    r->pos = pi + 1;
+    r->pos = r->last - (end - p) + 1;
     r->state = s_start;
 
     return 0;
@@ -3,26 +3,200 @@
 #endif
 
 #include <math.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
+#include "cache.h"
 #include "http.h"
+#include "logger.h"
+#include "pool.h"
+
+/* Request structures, output buffers, header records and read rings of the
+ * event loop running in this thread */
+static __thread pool_t request_pool;
+static __thread pool_t buffer_pool;
+static __thread pool_t header_pool;
+static __thread pool_t ring_pool;
+
+int http_request_pool_init(size_t prealloc, bool huge)
+{
+    if (pool_init(&request_pool, sizeof(http_request_t), prealloc, huge) < 0 ||
+        pool_init(&buffer_pool, MAX_OUT_BUF, prealloc, huge) < 0 ||
+        pool_init(&header_pool, MAX_HEADERS * sizeof(http_header_t), prealloc,
+                  huge) < 0)
+        return -1;
+    return pool_init_mirror(&ring_pool, MAX_BUF, prealloc);
+}
+
+http_request_t *http_request_alloc()
+{
+    return pool_alloc(&request_pool);
+}
+
+/* Client connections open in this event loop, and their limit (0: none) */
+static __thread int conn_count;
+static __thread int conn_limit;
+
+void http_conn_set_limit(int limit)
+{
+    conn_limit = limit;
+}
+
+/* Re-arm client connections with EPOLLONESHOT after each event */
+static __thread bool conn_oneshot;
+
+void http_conn_set_oneshot(bool oneshot)
+{
+    conn_oneshot = oneshot;
+}
+
+bool http_conn_oneshot()
+{
+    return conn_oneshot;
+}
+
+uint32_t http_conn_events()
+{
+    if (conn_oneshot)
+        return EPOLLIN | EPOLLET | EPOLLONESHOT;
+    return EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+}
+
+http_request_t *http_open_conn(int fd, int epfd, char *root)
+{
+    http_request_t *r = pool_alloc(&request_pool);
+    if (!r)
+        return NULL;
+
+    init_http_request(r, fd, epfd, root);
+    conn_count++;
+    return r;
+}
+
+bool http_conn_at_limit()
+{
+    return conn_limit && conn_count >= conn_limit;
+}
+
+bool http_conn_idle(http_request_t *r)
+{
+    /* An idle io_uring connection still has its receive in flight */
+    return r->out_head == r->out_tail && r->inflight == r->receiving;
+}
+
+size_t http_keepalive_timeout()
+{
+    int calm = conn_limit / 2;
+    if (!conn_limit || conn_count <= calm)
+        return TIMEOUT_DEFAULT;
+    if (conn_count >= conn_limit)
+        return TIMEOUT_MIN;
+
+    /* Shrink linearly from the default at half the limit to the minimum at
+     * the limit */
+    return TIMEOUT_DEFAULT - (size_t) (TIMEOUT_DEFAULT - TIMEOUT_MIN) *
+                                 (conn_count - calm) / (conn_limit - calm);
+}
+
+char *http_buffer_alloc()
+{
+    return pool_alloc(&buffer_pool);
+}
+
+void http_buffer_free(char *buf)
+{
+    pool_free(&buffer_pool, buf);
+}
+
+char *http_ring_alloc()
+{
+    return pool_alloc(&ring_pool);
+}
+
+void http_ring_free(char *buf)
+{
+    pool_free(&ring_pool, buf);
+}
+
+http_header_t *http_headers_alloc()
+{
+    return pool_alloc(&header_pool);
+}
+
+void http_headers_free(http_header_t *headers)
+{
+    pool_free(&header_pool, headers);
+}
+
+void http_report_pools()
+{
+    pool_report(&request_pool, "Request");
+    pool_report(&buffer_pool, "Buffer");
+    pool_report(&header_pool, "Header");
+    pool_report(&ring_pool, "Ring");
+}
 
 /**
  * @brief Closes a client connection.
  *
- * Closes the file descriptor and frees the request structure.
+ * Closes the file descriptor (and any file still queued for sending) and
+ * returns the request structure and its buffers to their pools, freeing any
+ * unprocessed headers. Its timer, if armed, is disarmed.
  * Note on epoll: When a file descriptor is closed, it is automatically removed
  * from the epoll set if no other file descriptors refer to the same open file description.
+ * Note on io_uring: requests in flight still refer to the connection. The
+ * socket is shut down so that they complete quickly, and the connection is
+ * released when the last one does.
  *
  * @param r The request structure.
  * @return int 0 on success.
  */
 int http_close_conn(http_request_t *r)
 {
+    del_timer(r);
+
+    if (r->inflight) {
+        if (!r->closing) {
+            r->closing = true;
+            shutdown(r->fd, SHUT_RDWR);
+            conn_count--;
+        }
+        return 0;
+    }
+
+    for (int i = r->out_head; i < r->out_tail; i++) {
+        if (r->out[i].cache)
+            cache_release(r->out[i].cache);
+        else if (!r->out[i].data)
+            close(r->out[i].fd);
+    }
+
+    list_head *pos, *n;
+    list_for_each_safe (pos, n, &(r->list)) {
+        list_del(pos);
+        http_header_free(r, list_entry(pos, http_header_t, list));
+    }
+
+    if (r->headers)
+        http_headers_free(r->headers);
+    if (r->buf)
+        http_ring_free(r->buf);
+    if (r->obuf)
+        http_buffer_free(r->obuf);
+
+    if (r->pipefd[0] >= 0) {
+        close(r->pipefd[0]);
+        close(r->pipefd[1]);
+    }
+
     close(r->fd);
-    free(r);
+    if (!r->closing)
+        conn_count--;
+    pool_free(&request_pool, r);
     return 0;
 }
 
@@ -63,11 +237,13 @@ static int http_process_if_modified_since(http_request_t *r UNUSED,
                                           char *data,
                                           int len UNUSED)
 {
-    struct tm tm;
+    /* strptime() leaves the fields it does not parse (tm_isdst among them)
+     * as they are, and the date is in GMT, not in local time */
+    struct tm tm = {0};
     if (!strptime(data, "%a, %d %b %Y %H:%M:%S GMT", &tm))
         return 0;
 
-    time_t client_time = mktime(&tm);
+    time_t client_time = timegm(&tm);
     double time_diff = difftime(out->mtime, client_time);
 
     /* Compare modified times.
@@ -80,12 +256,111 @@ static int http_process_if_modified_since(http_request_t *r UNUSED,
     return 0;
 }
 
-/* Dispatch table mapping header names to handler functions */
+/* Dispatch table mapping header names, in lower case, to handler functions */
 static http_header_handle_t http_headers_in[] = {
-    {"Host", http_process_ignore},
-    {"Connection", http_process_connection},
-    {"If-Modified-Since", http_process_if_modified_since},
-    {"", http_process_ignore}};
+    {"host", http_process_ignore},
+    {"connection", http_process_connection},
+    {"if-modified-since", http_process_if_modified_since},
+};
+
+#define N_HEADERS_IN (sizeof(http_headers_in) / sizeof(http_headers_in[0]))
+#define HEADER_TABLE_MAX_BITS 10
+
+/* Perfect hash table over the names of http_headers_in, built at startup by
+ * http_header_init(). A header name hashes to the one slot its handler can
+ * be in, so no name is compared more than once. */
+static struct {
+    const http_header_handle_t *handle; /* NULL if the slot is free */
+    size_t len;                         /* Length of the name */
+} header_table[1 << HEADER_TABLE_MAX_BITS];
+static uint32_t header_seed;
+static int header_shift;
+
+/**
+ * @brief Packs the length and the first two and last bytes of a header name,
+ * roughly folded to lower case, into a hash key.
+ *
+ * Folding with '| 0x20' also merges a few non-letters; a false hit this
+ * causes is rejected by header_name_equal().
+ */
+static inline uint32_t header_key(const char *name, size_t len)
+{
+    const uint8_t *p = (const uint8_t *) name;
+    return (uint32_t) (len & 0xff) | (uint32_t) (p[0] | 0x20) << 8 |
+           (uint32_t) (p[len > 1] | 0x20) << 16 |
+           (uint32_t) (p[len - 1] | 0x20) << 24;
+}
+
+static inline size_t header_slot(uint32_t key)
+{
+    return (uint32_t) (key * header_seed) >> header_shift;
+}
+
+/**
+ * @brief Folds the ASCII letters among 8 bytes to lower case at once.
+ */
+static inline uint64_t fold8(uint64_t x)
+{
+    uint64_t heptets = x & 0x7f7f7f7f7f7f7f7fULL;
+    uint64_t ge_A = heptets + 0x3f3f3f3f3f3f3f3fULL; /* Bit 7: byte >= 'A' */
+    uint64_t gt_Z = heptets + 0x2525252525252525ULL; /* Bit 7: byte > 'Z' */
+    uint64_t upper = ge_A & ~gt_Z & ~x & 0x8080808080808080ULL;
+    return x | (upper >> 2);
+}
+
+/**
+ * @brief Compares a header name case-insensitively with a lower case name of
+ * the same length, 8 bytes at a time.
+ */
+static bool header_name_equal(const char *key, const char *name, size_t len)
+{
+    uint64_t a, b;
+
+    for (; len >= 8; key += 8, name += 8, len -= 8) {
+        memcpy(&a, key, 8);
+        memcpy(&b, name, 8);
+        if (fold8(a) != b)
+            return false;
+    }
+
+    a = b = 0;
+    memcpy(&a, key, len);
+    memcpy(&b, name, len);
+    return fold8(a) == b;
+}
+
+void http_header_init()
+{
+    /* Look for a multiplier under which no two names share a slot, in the
+     * smallest table at most half full */
+    int bits = 1;
+    while ((1u << bits) < 2 * N_HEADERS_IN)
+        bits++;
+
+    for (; bits <= HEADER_TABLE_MAX_BITS; bits++) {
+        header_shift = 32 - bits;
+        for (header_seed = 0x9e3779b1; header_seed < 0x9e3779b1 + 2048;
+             header_seed += 2) {
+            bool perfect = true;
+            memset(header_table, 0, sizeof(header_table));
+
+            for (size_t i = 0; i < N_HEADERS_IN && perfect; i++) {
+                const char *name = http_headers_in[i].name;
+                size_t len = strlen(name);
+                size_t slot = header_slot(header_key(name, len));
+
+                if (header_table[slot].handle)
+                    perfect = false;
+                header_table[slot].handle = &http_headers_in[i];
+                header_table[slot].len = len;
+            }
+            if (perfect)
+                return;
+        }
+    }
+    log_err("No perfect hash for the header names, extend header_key()");
+    abort();
+}
 
 /**
  * @brief Processes all parsed headers.
@@ -102,20 +377,24 @@ void http_handle_header(http_request_t *r, http_out_t *o)
     /* Iterate over the list safely (safe against deletion) */
     list_for_each_safe (pos, n, &(r->list)) {
         http_header_t *header = list_entry(pos, http_header_t, list);
+        size_t len = (char *) header->key_end - (char *) header->key_start;
+
+        /* Find the handler for this header: the only candidate is the one in
+         * its slot, and the whole name has to match */
+        if (len > 0) {
+            size_t slot = header_slot(header_key(header->key_start, len));
+            const http_header_handle_t *header_in = header_table[slot].handle;
 
-        /* Find the handler for this header */
-        for (http_header_handle_t *header_in = http_headers_in;
-             strlen(header_in->name) > 0; header_in++) {
-            if (!strncmp(header->key_start, header_in->name,
-                         header->key_end - header->key_start)) {
-                int len = header->value_end - header->value_start;
-                (*(header_in->handler))(r, o, header->value_start, len);
-                break;
+            if (header_in && header_table[slot].len == len &&
+                header_name_equal(header->key_start, header_in->name, len)) {
+                int vlen = header->value_end - header->value_start;
+                (*(header_in->handler))(r, o, header->value_start, vlen);
             }
         }
 
         /* Delete the header from the list and free memory */
         list_del(pos);
-        free(header);
+        http_header_free(r, header);
     }
+    r->nheaders = 0;
 }
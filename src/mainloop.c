@@ -16,36 +16,51 @@
  *    This requires us to read/write *everything* until EAGAIN is returned.
  */
 
+#define _GNU_SOURCE /* for sched_setaffinity() and CPU_SET() */
 #include <arpa/inet.h>
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <linux/filter.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/prctl.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+#include "cache.h"
 #include "http.h"
 #include "logger.h"
+#include "pool.h"
 #include "timer.h"
+#include "uring.h"
 
 /* The maximum number of events to process at once in the event loop */
 #define MAXEVENTS 1024
 /* The backlog size for the listen socket (pending connection queue) */
 #define LISTENQ 1024
+/* Connections accepted per pass of the event loop by default */
+#define DEFAULT_ACCEPT_BUDGET 64
 
 /**
  * @brief Opens a listening socket on the specified port.
  *
  * @param port The port number to listen on.
+ * @param reuseport Let several sockets listen on the port (SO_REUSEPORT).
  * @return int The file descriptor of the listening socket, or -1 on error.
  */
-static int open_listenfd(int port)
+static int open_listenfd(int port, bool reuseport)
 {
     int listenfd, optval = 1;
 
@@ -61,6 +76,13 @@ static int open_listenfd(int port)
                    sizeof(int)) < 0)
         return -1;
 
+    /* Each worker listens on its own socket bound to the same port. The
+     * kernel balances new connections across all sockets of the group.
+     */
+    if (reuseport && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+                                (const void *) &optval, sizeof(int)) < 0)
+        return -1;
+
     /* Listenfd will be an endpoint for all requests to given port. */
     struct sockaddr_in serveraddr = {
         .sin_family = AF_INET,
@@ -143,9 +165,96 @@ static int cmd_get_port(char *arg_port)
     return ret;
 }
 
+/**
+ * @brief Helper to parse the file cache budget (in MiB) from string.
+ *
+ * @param arg_size The string argument.
+ * @return size_t The budget in bytes or exits on failure.
+ */
+static size_t cmd_get_cache_size(char *arg_size)
+{
+    char *endptr;
+
+    errno = 0;
+    long ret = strtol(arg_size, &endptr, 10);
+    if (errno != 0 || endptr == arg_size || *endptr != '\0' || ret < 0) {
+        fprintf(stderr, "Invalid cache size: %s\n", arg_size);
+        exit(EXIT_FAILURE);
+    }
+    return (size_t) ret << 20;
+}
+
+#define MAX_WORKERS 1024
+#define DEFAULT_PREALLOC 128
+
+/**
+ * @brief Helper to parse a number of connections from string.
+ *
+ * @param arg_conns The string argument.
+ * @return size_t The number of connections or exits on failure.
+ */
+static size_t cmd_get_conns(char *arg_conns)
+{
+    char *endptr;
+
+    errno = 0;
+    long ret = strtol(arg_conns, &endptr, 10);
+    if (errno != 0 || endptr == arg_conns || *endptr != '\0' || ret < 0 ||
+        ret > INT_MAX) {
+        fprintf(stderr, "Invalid number of connections: %s\n", arg_conns);
+        exit(EXIT_FAILURE);
+    }
+    return ret;
+}
+
+/**
+ * @brief Helper to parse the number of workers (threads or processes) from string.
+ *
+ * @param arg_workers The string argument.
+ * @return int The number of workers or exits on failure.
+ */
+static int cmd_get_workers(char *arg_workers)
+{
+    char *endptr;
+
+    errno = 0;
+    long ret = strtol(arg_workers, &endptr, 10);
+    if (errno != 0 || endptr == arg_workers || *endptr != '\0' || ret < 1 ||
+        ret > MAX_WORKERS) {
+        fprintf(stderr, "Invalid number of workers: %s\n", arg_workers);
+        exit(EXIT_FAILURE);
+    }
+    return ret;
+}
+
+static int cmd_get_backend(const char *name);
+
 struct runtime_conf {
     int port;
     char *web_root;
+    size_t cache_size; /* File cache budget in bytes */
+    int workers;       /* Number of event loops */
+    bool prefork;      /* Run the event loops in processes, not threads */
+    size_t prealloc;   /* Connections preallocated by each event loop */
+    bool hugepages;    /* Back connection pools with huge pages */
+    bool timerfd;      /* Drive timers with a timerfd */
+    int max_conns;     /* Limit of open connections, 0 for no limit */
+    bool oneshot;      /* Re-arm connections with EPOLLONESHOT */
+    int accept_budget; /* Connections accepted per pass, 0 for no limit */
+    int backend;       /* Index of the event loop implementation to use */
+    bool uring_files;  /* Send file bodies with io_uring (epoll loop) */
+};
+
+/**
+ * @brief An event loop with its own listening socket.
+ */
+struct worker {
+    int id;
+    int listenfd;
+    struct runtime_conf *cfg;
+    pthread_t thread;
+    pid_t pid;      /* Worker process (prefork mode) */
+    cpu_set_t cpus; /* CPUs the worker process is pinned to */
 };
 
 /**
@@ -162,8 +271,19 @@ static struct runtime_conf *parse_cmd(int argc, char **argv)
 
     cfg->port = DEFAULT_PORT;
     cfg->web_root = DEFAULT_WEBROOT;
+    cfg->cache_size = CACHE_DEFAULT_SIZE;
+    cfg->workers = 1;
+    cfg->prefork = false;
+    cfg->prealloc = DEFAULT_PREALLOC;
+    cfg->hugepages = false;
+    cfg->timerfd = false;
+    cfg->max_conns = 0;
+    cfg->oneshot = false;
+    cfg->accept_budget = DEFAULT_ACCEPT_BUDGET;
+    cfg->backend = cmd_get_backend("epoll");
+    cfg->uring_files = false;
 
-    while ((cmdopt = getopt(argc, argv, "p:r:")) != -1) {
+    while ((cmdopt = getopt(argc, argv, "p:w:m:t:P:n:HTc:Oa:b:u")) != -1) {
         switch (cmdopt) {
         case 'p':
             cfg->port = cmd_get_port(optarg);
@@ -171,6 +291,42 @@ static struct runtime_conf *parse_cmd(int argc, char **argv)
         case 'w':
             cfg->web_root = optarg;
             break;
+        case 'm':
+            cfg->cache_size = cmd_get_cache_size(optarg);
+            break;
+        case 't':
+        case 'P':
+            if (cfg->workers > 1 && cfg->prefork != (cmdopt == 'P')) {
+                fprintf(stderr, "Options -t and -P are mutually exclusive\n");
+                exit(EXIT_FAILURE);
+            }
+            cfg->workers = cmd_get_workers(optarg);
+            cfg->prefork = cmdopt == 'P';
+            break;
+        case 'n':
+            cfg->prealloc = cmd_get_conns(optarg);
+            break;
+        case 'H':
+            cfg->hugepages = true;
+            break;
+        case 'T':
+            cfg->timerfd = true;
+            break;
+        case 'c':
+            cfg->max_conns = cmd_get_conns(optarg);
+            break;
+        case 'O':
+            cfg->oneshot = true;
+            break;
+        case 'a':
+            cfg->accept_budget = cmd_get_conns(optarg);
+            break;
+        case 'b':
+            cfg->backend = cmd_get_backend(optarg);
+            break;
+        case 'u':
+            cfg->uring_files = true;
+            break;
         case '?':
             fprintf(stderr, "Illegal option: -%c\n",
                     isprint(optopt) ? optopt : '#');
@@ -185,61 +341,171 @@ static struct runtime_conf *parse_cmd(int argc, char **argv)
     return cfg;
 }
 
-int main(int argc, char **argv)
+/* Number of SIGUSR1 received, each one asks the workers for statistics */
+static volatile sig_atomic_t stats_requests;
+
+static void stats_handler(int signo UNUSED)
 {
-    struct runtime_conf *cfg = parse_cmd(argc, argv);
+    stats_requests++;
+}
 
-    /* Ignore SIGPIPE signal.
-     * When writing to a connection that the client has closed, the system
-     * sends SIGPIPE. By default, this kills the process. We want to ignore it
-     * and handle the error code (EPIPE) from write() instead.
-     */
-    if (sigaction(SIGPIPE,
-                  &(struct sigaction){.sa_handler = SIG_IGN, .sa_flags = 0},
-                  NULL)) {
-        log_err("Failed to install signal handler for SIGPIPE");
-        return 0;
-    }
+/**
+ * @brief Prints the occupancy of the pools of the worker if SIGUSR1 was
+ * received since the last call.
+ */
+static void worker_report(struct worker *w, sig_atomic_t *stats_seen)
+{
+    if (*stats_seen == stats_requests)
+        return;
+
+    *stats_seen = stats_requests;
+    fprintf(stderr, "Worker %d (pid %d):\n", w->id, (int) getpid());
+    http_report_pools();
+}
+
+/**
+ * @brief Closes idle connections and runs expired timers, once the events
+ * of a pass of the event loop are handled.
+ *
+ * @param room Whether connections wait to be accepted at the limit.
+ * @return bool False if room was wanted and no idle connection was left to
+ *         close for it.
+ */
+static bool worker_expire(bool room)
+{
+    /* Close the connections that have been idle for the longest time,
+     * which are the first due on the timer wheel since all their timers
+     * are armed with the same timeout: one to make room for a connection
+     * waiting at the limit, and those idle for longer than the keep-alive
+     * timeout, which shrinks as the limit gets closer. Connections with a
+     * response going out are left alone. Like expired timers, this waits
+     * until the events are handled, as they may refer to the victims. */
+    bool made = !room || !http_conn_at_limit() ||
+                expire_oldest_timer(SIZE_MAX, http_conn_idle);
+    size_t early = TIMEOUT_DEFAULT - http_keepalive_timeout();
+    while (early && expire_oldest_timer(early, http_conn_idle))
+        ;
+
+    /* Process any expired timers. This comes after the events, which
+     * may still refer to connections whose timers just expired. */
+    handle_expired_timers();
+    return made;
+}
 
-    /* 1. Initialize the listening socket */
-    int listenfd = open_listenfd(cfg->port);
-    int rc UNUSED = sock_set_non_blocking(listenfd);
-    assert(rc == 0 && "sock_set_non_blocking");
+/**
+ * @brief Bounds the wait of the event loop for timers.
+ *
+ * The shrunk keep-alive timeout closes idle connections ahead of their
+ * timers, which the wheel does not wake up for; the loop then wakes up at
+ * least as often as that timeout can be.
+ */
+static int worker_wait_time()
+{
+    int time = find_timer();
+    if (http_keepalive_timeout() < TIMEOUT_DEFAULT &&
+        (time < 0 || time > TIMEOUT_MIN))
+        time = TIMEOUT_MIN;
+    return time;
+}
+
+/* Size of the submission queue of the io_uring event loop, and of the ring
+ * the epoll event loop sends file bodies with */
+#define URING_ENTRIES 1024
+
+/**
+ * @brief Runs the event loop of a worker on epoll(7).
+ *
+ * @param w The worker.
+ * @param listener Request object of the listening socket of the worker.
+ * @return int Never returns.
+ */
+static int epoll_loop(struct worker *w, http_request_t *listener)
+{
+    struct runtime_conf *cfg = w->cfg;
+    int listenfd = w->listenfd;
+    sig_atomic_t stats_seen = stats_requests;
+    http_request_t *request;
 
     /* 2. Create an epoll instance */
     /* epoll_create1(0) is the newer version of epoll_create() */
     int epfd = epoll_create1(0 /* flags */);
     assert(epfd > 0 && "epoll_create1");
+    listener->epfd = epfd;
 
     /* Buffer to store events returned by epoll_wait */
     struct epoll_event *events = malloc(sizeof(struct epoll_event) * MAXEVENTS);
     assert(events && "epoll_event: malloc");
 
-    /* Create the request object for the listening socket.
-     * Even though it's not a client request, we use the structure to track it. */
-    http_request_t *request = malloc(sizeof(http_request_t));
-    init_http_request(request, listenfd, epfd, cfg->web_root);
-
     /* 3. Register the listening socket with epoll */
     struct epoll_event event = {
-        .data.ptr = request,
+        .data.ptr = listener,
         /* EPOLLIN: Ready to read (accept connection)
-         * EPOLLET: Edge Triggered mode. We get notified only on state change. */
-        .events = EPOLLIN | EPOLLET,
+         * Level triggered: a pass accepts at most 'accept_budget' connections,
+         * and the socket keeps being reported while more are pending. Only
+         * this worker polls the socket, so there is no thundering herd. */
+        .events = EPOLLIN,
     };
     epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &event);
 
-    /* Initialize the timer system */
-    timer_init();
+    http_conn_set_oneshot(cfg->oneshot);
 
-    printf("Web server started.\n");
+    /* Optionally let a timerfd in the epoll set wake the loop for timers,
+     * tracked with a request object like the listening socket */
+    int timerfd = cfg->timerfd ? timer_fd_init() : -1;
+    if (timerfd >= 0) {
+        request = http_request_alloc();
+        init_http_request(request, timerfd, epfd, cfg->web_root);
+        event.data.ptr = request;
+        event.events = EPOLLIN | EPOLLET;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, timerfd, &event);
+    }
+
+    /* Register the inotify descriptor that keeps the file cache coherent.
+     * Like the listening socket, it is tracked with a request object. */
+    int watchfd = cache_watch_init(cfg->web_root);
+    if (watchfd >= 0) {
+        request = http_request_alloc();
+        init_http_request(request, watchfd, epfd, cfg->web_root);
+        event.data.ptr = request;
+        event.events = EPOLLIN | EPOLLET;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, watchfd, &event);
+    }
+
+    /* Optionally hand file bodies to an io_uring instance, so that reading
+     * large files does not block the loop. Its completion eventfd joins the
+     * epoll set, tracked with a request object as well. */
+    uring_t ring;
+    int uringfd = -1;
+    if (cfg->uring_files) {
+        if (uring_init(&ring, URING_ENTRIES, IORING_SETUP_SINGLE_ISSUER) < 0) {
+            log_err("io_uring unavailable, sending files with sendfile");
+        } else if ((uringfd = http_uring_files_init(&ring)) < 0) {
+            log_err("io_uring eventfd, sending files with sendfile");
+            uring_exit(&ring);
+        } else {
+            request = http_request_alloc();
+            init_http_request(request, uringfd, epfd, cfg->web_root);
+            event.data.ptr = request;
+            event.events = EPOLLIN | EPOLLET;
+            epoll_ctl(epfd, EPOLL_CTL_ADD, uringfd, &event);
+        }
+    }
 
-    /* 4. The Main Event Loop */
+    /* Whether connections were left to wait at the connection limit in
+     * this pass, and whether no idle connection was left to close for them
+     * in the last one */
+    bool want_room = false, no_room = false;
+
+    /* 4. The Event Loop */
     while (1) {
         /* Determine how long to wait for events based on the next timer expiration */
-        int time = find_timer();
+        int time = worker_wait_time();
         debug("wait time = %d", time);
 
+        /* File bodies queued in this pass go to the kernel in one call */
+        if (uringfd >= 0)
+            uring_submit(&ring);
+
         /* Wait for events.
          * epoll_wait blocks until:
          * 1. A file descriptor is ready (returns number of events > 0)
@@ -248,10 +514,13 @@ int main(int argc, char **argv)
          */
         int n = epoll_wait(epfd, events, MAXEVENTS, time);
 
-        /* Process any expired timers */
-        handle_expired_timers();
+        /* Timers of this iteration all use the time of this wakeup */
+        time_update();
+
+        worker_report(w, &stats_seen);
 
         /* Iterate over the ready events */
+        bool uring_ready = false;
         for (int i = 0; i < n; i++) {
             http_request_t *r = events[i].data.ptr;
             int fd = r->fd;
@@ -259,56 +528,92 @@ int main(int argc, char **argv)
             if (listenfd == fd) {
                 /* Case 1: Notification on the listening socket -> New Connection(s) */
 
-                /* Since we are in Edge Triggered (EPOLLET) mode, we must accept
-                 * ALL pending connections until accept() returns EAGAIN.
-                 * Otherwise, we might miss connections that arrived simultaneously. */
-                while (1) {
-                    socklen_t inlen = 1;
-                    struct sockaddr_in clientaddr;
-                    int infd = accept(listenfd, (struct sockaddr *) &clientaddr,
-                                      &inlen);
+                /* Accept pending connections until accept4() returns
+                 * EAGAIN, or up to the budget so that a burst of new clients
+                 * does not delay the events of existing ones. Connections
+                 * left pending are taken on the next pass since the
+                 * listening socket is level triggered. */
+                for (int accepted = 0;
+                     !cfg->accept_budget || accepted < cfg->accept_budget;
+                     accepted++) {
+                    /* At the connection limit, new connections wait in the
+                     * backlog. One is known to wait if the limit was reached
+                     * before this pass accepted any, and the end of the pass
+                     * then closes an idle connection to make room. If none
+                     * was left to close last time, new connections are
+                     * turned away instead, or the listening socket would
+                     * keep waking the loop up until a connection closes. */
+                    bool full = http_conn_at_limit();
+                    if (full && !no_room) {
+                        want_room = accepted == 0;
+                        break;
+                    }
+
+                    /* The new connection is made non-blocking and
+                     * close-on-exec by accept4() itself, saving two fcntl()
+                     * calls */
+                    int infd = accept4(listenfd, NULL, NULL,
+                                       SOCK_NONBLOCK | SOCK_CLOEXEC);
                     if (infd < 0) {
                         if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
                             /* We have processed all incoming connections */
                             break;
                         }
-                        log_err("accept");
+                        if (errno == ECONNABORTED || errno == EINTR)
+                            continue;
+                        log_err("accept4");
                         break;
                     }
+                    if (full) {
+                        close(infd);
+                        continue;
+                    }
 
-                    /* Make the new connection non-blocking */
-                    rc = sock_set_non_blocking(infd);
-                    assert(rc == 0 && "sock_set_non_blocking");
-
-                    /* Create a new request object for this client */
-                    request = malloc(sizeof(http_request_t));
+                    /* Take a request object for this client from the pool */
+                    request = http_open_conn(infd, epfd, cfg->web_root);
                     if (!request) {
-                        log_err("malloc");
-                        break;
+                        log_err("http_open_conn");
+                        close(infd);
+                        continue;
                     }
 
-                    init_http_request(request, infd, epfd, cfg->web_root);
-
-                    /* Register the new connection with epoll */
+                    /* Register the new connection with epoll.
+                     * No other thread waits on this epoll set, so by default
+                     * the connection is registered once for both directions
+                     * and never re-armed. With -O, EPOLLONESHOT disables the
+                     * event after one notification and do_request() re-arms
+                     * it, as a dispatcher sharing the set between threads
+                     * would need. */
                     event.data.ptr = request;
-                    /* EPOLLONESHOT: Disable the event after one notification.
-                     * We will re-enable it later. This prevents race conditions
-                     * if multiple threads were used (though this server is single-threaded). */
-                    event.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
+                    event.events = http_conn_events();
                     epoll_ctl(epfd, EPOLL_CTL_ADD, infd, &event);
 
                     /* Add a timer to close the connection if idle for too long */
                     add_timer(request, TIMEOUT_DEFAULT, http_close_conn);
                 }
+            } else if (timerfd == fd) {
+                /* Case 2: The timerfd expired -> Timers run below */
+                timer_fd_handle();
+            } else if (watchfd == fd) {
+                /* Case 3: Files under the web root changed -> Invalidate
+                 * the affected cache entries */
+                cache_watch_handle();
+            } else if (uringfd == fd) {
+                /* Case 4: io_uring sent file bodies -> Carry on with
+                 * their connections once the other events are handled,
+                 * since doing so may close connections that have events
+                 * further down the list */
+                uring_ready = true;
             } else {
-                /* Case 2: Notification on a client socket -> Data ready or Error */
+                /* Case 5: Notification on a client socket -> Data ready,
+                 * room to continue a pending response, or Error */
 
                 if ((events[i].events & EPOLLERR) ||
                     (events[i].events & EPOLLHUP) ||
-                    (!(events[i].events & EPOLLIN))) {
+                    (!(events[i].events & (EPOLLIN | EPOLLOUT)))) {
                     /* An error occurred on this file descriptor */
                     log_err("epoll error fd: %d", r->fd);
-                    close(fd);
+                    http_close_conn(r);
                     continue;
                 }
 
@@ -316,8 +621,488 @@ int main(int argc, char **argv)
                 do_request(events[i].data.ptr);
             }
         }
+
+        if (uring_ready)
+            http_uring_files_handle();
+
+        no_room = !worker_expire(want_room);
+        want_room = false;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Queues a multishot request on a descriptor of the event loop.
+ *
+ * Listening sockets get a multishot accept, which completes once for every
+ * new connection; the timerfd and the inotify descriptor get a multishot
+ * poll. Both only need queueing again when the kernel ends them.
+ */
+static int uring_arm(uring_t *ring, http_request_t *r, int op)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (!sqe)
+        return -1;
+
+    sqe->fd = r->fd;
+    sqe->user_data = uring_data(r, op);
+    if (op == HTTP_URING_ACCEPT) {
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        /* The listening socket is non-blocking: when no connection is
+         * pending, io_uring arms a poll on it instead of failing. The
+         * accepted sockets are non-blocking as well, so that a splice to a
+         * full socket comes back rather than holding a kernel worker. */
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    } else {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->len = IORING_POLL_ADD_MULTI;
+        sqe->poll32_events = POLLIN;
+    }
+    return 0;
+}
+
+/* Multishot requests of the io_uring event loop: on the listening socket,
+ * the timerfd and the inotify descriptor */
+#define URING_MULTISHOTS 3
+
+/* Longest wait of the io_uring event loop while a multishot request the
+ * kernel ended could not be queued again, in ms */
+#define URING_REARM_DELAY 10
+
+/**
+ * @brief Runs the event loop of a worker on io_uring(7).
+ *
+ * New connections, data received and the progress of responses all arrive
+ * as completions, and the requests they lead to are submitted together
+ * with the next wait, so a request is served without system calls of its
+ * own. Needs Linux 5.19 for multishot accept and rings of provided buffers.
+ *
+ * @param w The worker.
+ * @param listener Request object of the listening socket of the worker.
+ * @return int -1 if the kernel does not support it, never returns otherwise.
+ */
+static int uring_loop(struct worker *w, http_request_t *listener)
+{
+    struct runtime_conf *cfg = w->cfg;
+    sig_atomic_t stats_seen = stats_requests;
+    uring_t ring;
+    http_request_t *request;
+
+    /* Only this thread submits, and completions are only needed when it
+     * waits for them */
+    if (uring_init(&ring, URING_ENTRIES,
+                   IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN) <
+        0)
+        return -1;
+
+    if (http_uring_init(&ring) < 0 ||
+        uring_arm(&ring, listener, HTTP_URING_ACCEPT) < 0) {
+        /* Leave nothing pointing to the ring to the fallback event loop */
+        http_uring_exit();
+        uring_exit(&ring);
+        return -1;
+    }
+
+    /* Multishot requests that could not be queued, for lack of room in the
+     * submission queue, are queued on a later pass. The loop wakes up soon
+     * meanwhile, as a listening socket left without one accepts nothing. */
+    http_request_t *unarmed[URING_MULTISHOTS];
+    int nunarmed = 0;
+
+    int timerfd = cfg->timerfd ? timer_fd_init() : -1;
+    if (timerfd >= 0) {
+        request = http_request_alloc();
+        init_http_request(request, timerfd, -1, cfg->web_root);
+        if (uring_arm(&ring, request, HTTP_URING_POLL) < 0)
+            unarmed[nunarmed++] = request;
+    }
+
+    int watchfd = cache_watch_init(cfg->web_root);
+    if (watchfd >= 0) {
+        request = http_request_alloc();
+        init_http_request(request, watchfd, -1, cfg->web_root);
+        if (uring_arm(&ring, request, HTTP_URING_POLL) < 0)
+            unarmed[nunarmed++] = request;
+    }
+
+    while (1) {
+        for (int i = 0; i < nunarmed; i++) {
+            http_request_t *r = unarmed[i];
+            int op = r == listener ? HTTP_URING_ACCEPT : HTTP_URING_POLL;
+            if (uring_arm(&ring, r, op) == 0)
+                unarmed[i--] = unarmed[--nunarmed];
+        }
+
+        int time = worker_wait_time();
+        if (nunarmed && (time < 0 || time > URING_REARM_DELAY))
+            time = URING_REARM_DELAY;
+
+        int rc UNUSED = uring_wait(&ring, time);
+        assert(rc == 0 && "uring_wait");
+
+        /* Timers of this iteration all use the time of this wakeup */
+        time_update();
+
+        worker_report(w, &stats_seen);
+
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek(&ring))) {
+            http_request_t *r = uring_ptr(cqe->user_data);
+            int op = uring_op(cqe->user_data);
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            uring_advance(&ring);
+
+            /* Multishot requests the kernel ended are queued again */
+            if ((op == HTTP_URING_ACCEPT || op == HTTP_URING_POLL) &&
+                !(flags & IORING_CQE_F_MORE) && uring_arm(&ring, r, op) < 0) {
+                log_err("io_uring submission queue, re-arming later");
+                unarmed[nunarmed++] = r;
+            }
+
+            /* Each completion of the multishot accept is one connection,
+             * served in turn with the completions of the connections
+             * already open, so there is no accept budget (-a) to apply:
+             * the completion queue bounds the connections of a pass. */
+            if (op == HTTP_URING_ACCEPT) {
+                if (res < 0) {
+                    log_err("accept, res = %d", res);
+                    continue;
+                }
+
+                /* At the connection limit, the connection idle for the
+                 * longest time makes room for the new one, which is turned
+                 * away if there is none. Closing it here is safe, as it is
+                 * only released once its requests in flight complete. */
+                if (http_conn_at_limit() &&
+                    !expire_oldest_timer(SIZE_MAX, http_conn_idle)) {
+                    close(res);
+                    continue;
+                }
+
+                request = http_open_conn(res, -1, cfg->web_root);
+                if (!request) {
+                    log_err("http_open_conn");
+                    close(res);
+                    continue;
+                }
+                http_uring_open(request);
+            } else if (op == HTTP_URING_POLL) {
+                if (r->fd == timerfd)
+                    timer_fd_handle();
+                else
+                    cache_watch_handle();
+            } else {
+                http_uring_complete(r, op, res, flags);
+            }
+        }
+
+        worker_expire(false);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief An implementation of the event loop.
+ */
+struct backend {
+    const char *name;
+    /* Runs the event loop of a worker; only returns, with -1, if the
+     * kernel does not support the backend */
+    int (*run)(struct worker *w, http_request_t *listener);
+};
+
+/* The last backend works everywhere and is the fallback of the others */
+static const struct backend backends[] = {
+    {"io_uring", uring_loop},
+    {"epoll", epoll_loop},
+};
+
+#define NBACKENDS ((int) (sizeof(backends) / sizeof(backends[0])))
+
+/**
+ * @brief Helper to find an event loop implementation by name.
+ *
+ * @param name The string argument.
+ * @return int Index of the backend or exits on failure.
+ */
+static int cmd_get_backend(const char *name)
+{
+    for (int i = 0; i < NBACKENDS; i++) {
+        if (!strcmp(name, backends[i].name))
+            return i;
+    }
+
+    fprintf(stderr, "Unknown event loop backend: %s\n", name);
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * @brief Runs the event loop of one worker.
+ *
+ * Every worker owns a listening socket, an event loop, a timer queue and
+ * a file cache, so workers share nothing while serving requests. The timer
+ * and cache modules keep their state in thread-local storage.
+ *
+ * @param arg The worker (struct worker *).
+ * @return void* Never returns.
+ */
+static void *worker_run(void *arg)
+{
+    struct worker *w = arg;
+    struct runtime_conf *cfg = w->cfg;
+    int rc UNUSED;
+
+    /* Preallocate the request objects of the connections of this worker */
+    rc = http_request_pool_init(cfg->prealloc, cfg->hugepages);
+    assert(rc == 0 && "http_request_pool_init");
+
+    /* Create the request object for the listening socket.
+     * Even though it's not a client request, we use the structure to track it. */
+    http_request_t *listener = http_request_alloc();
+    init_http_request(listener, w->listenfd, -1, cfg->web_root);
+
+    /* Initialize the timer system */
+    timer_init();
+
+    /* Like the cache budget, the connection limit is split between the
+     * workers */
+    if (cfg->max_conns)
+        http_conn_set_limit(cfg->max_conns > cfg->workers
+                                ? cfg->max_conns / cfg->workers
+                                : 1);
+
+    /* Initialize the in-memory file cache, the budget is split between the
+     * workers since each one has its own cache */
+    rc = cache_init(cfg->cache_size / cfg->workers);
+    assert(rc == 0 && "cache_init");
+
+    for (int i = cfg->backend; i < NBACKENDS; i++) {
+        if (backends[i].run(w, listener) == 0)
+            break;
+        log_err("Worker %d cannot use %s, falling back to %s", w->id,
+                backends[i].name, backends[i + 1].name);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Finds the CPUs whose connections are steered to a worker.
+ *
+ * The steering program maps a connection received on CPU c to the listener
+ * at index c % nworkers of the SO_REUSEPORT group, that is worker c %
+ * nworkers, since listeners join the group in the order they are opened.
+ *
+ * @param id Index of the worker.
+ * @param nworkers Number of workers.
+ * @param set Receives the CPUs of the worker that this process may use.
+ * @return bool True if the set is not empty.
+ */
+static bool worker_cpus(int id, int nworkers, cpu_set_t *set)
+{
+    cpu_set_t allowed;
+
+    CPU_ZERO(set);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+        return false;
+
+    for (int cpu = id; cpu < CPU_SETSIZE; cpu += nworkers) {
+        if (CPU_ISSET(cpu, &allowed))
+            CPU_SET(cpu, set);
+    }
+    return CPU_COUNT(set) > 0;
+}
+
+/**
+ * @brief Steers new connections to the listener of the receiving CPU.
+ *
+ * Attaches a classic BPF program to the SO_REUSEPORT group of 'listenfd'
+ * which selects the listening socket by the CPU that processed the SYN, so
+ * a connection is accepted and served on the core that received it.
+ *
+ * @param listenfd Any listening socket of the group.
+ * @param nworkers Number of sockets in the group.
+ * @return int 0 on success, -1 on error.
+ */
+static int attach_cpu_steering(int listenfd, int nworkers)
+{
+    struct sock_filter code[] = {
+        /* A = current CPU */
+        {BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU},
+        /* A = A % nworkers */
+        {BPF_ALU | BPF_MOD | BPF_K, 0, 0, (unsigned) nworkers},
+        /* Return A, the index of the socket in the group */
+        {BPF_RET | BPF_A, 0, 0, 0},
+    };
+    struct sock_fprog prog = {
+        .len = sizeof(code) / sizeof(code[0]),
+        .filter = code,
+    };
+
+    return setsockopt(listenfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+                      sizeof(prog));
+}
+
+/**
+ * @brief Forks the process of a worker (prefork mode).
+ *
+ * The child pins itself to the CPUs of the worker, drops the listening
+ * sockets of the other workers and runs the event loop. It is killed when
+ * the parent exits.
+ *
+ * @param workers All workers.
+ * @param id Index of the worker to start.
+ * @param pin Pin the process to 'cpus' of the worker.
+ * @return int 0 in the parent on success, -1 on error.
+ */
+static int worker_spawn(struct worker *workers, int id, bool pin)
+{
+    struct worker *w = &workers[id];
+    pid_t parent = getpid();
+
+    w->pid = fork();
+    if (w->pid < 0) {
+        log_err("Failed to fork worker %d", id);
+        return -1;
+    }
+    if (w->pid > 0)
+        return 0;
+
+    if (prctl(PR_SET_PDEATHSIG, SIGTERM) < 0 || getppid() != parent)
+        exit(EXIT_FAILURE);
+
+    if (pin && sched_setaffinity(0, sizeof(w->cpus), &w->cpus) < 0)
+        log_err("Failed to pin worker %d", id);
+
+    for (int i = 0; i < w->cfg->workers; i++) {
+        if (i != id)
+            close(workers[i].listenfd);
+    }
+
+    worker_run(w);
+    exit(EXIT_SUCCESS);
+}
+
+/**
+ * @brief Runs the workers in processes and restarts those that exit.
+ *
+ * The parent keeps every listening socket open: a socket that left the
+ * SO_REUSEPORT group would shift the indices used by the steering program,
+ * and the socket of a crashed worker is inherited by its replacement.
+ *
+ * @param workers All workers.
+ * @param n Number of workers.
+ * @return int Only returns, with -1, if workers cannot be started.
+ */
+static int prefork_run(struct worker *workers, int n)
+{
+    bool steer = true;
+
+    for (int i = 0; i < n; i++)
+        steer = worker_cpus(i, n, &workers[i].cpus) && steer;
+
+    if (!steer)
+        log_err("Fewer usable CPUs than workers, not pinning workers");
+    else if (attach_cpu_steering(workers[0].listenfd, n) < 0)
+        log_err("Failed to attach the reuseport steering program");
+
+    for (int i = 0; i < n; i++) {
+        if (worker_spawn(workers, i, steer) < 0)
+            return -1;
+    }
+
+    for (;;) {
+        int status;
+        pid_t pid = wait(&status);
+        if (pid < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (workers[i].pid != pid)
+                continue;
+            log_err("Worker %d exited with status %d, restarting", i, status);
+            if (worker_spawn(workers, i, steer) < 0)
+                return -1;
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    struct runtime_conf *cfg = parse_cmd(argc, argv);
+
+    /* Ignore SIGPIPE signal.
+     * When writing to a connection that the client has closed, the system
+     * sends SIGPIPE. By default, this kills the process. We want to ignore it
+     * and handle the error code (EPIPE) from write() instead.
+     */
+    if (sigaction(SIGPIPE,
+                  &(struct sigaction){.sa_handler = SIG_IGN, .sa_flags = 0},
+                  NULL)) {
+        log_err("Failed to install signal handler for SIGPIPE");
+        return 0;
+    }
+
+    /* SIGUSR1 makes every worker print the occupancy of its pools. */
+    if (sigaction(SIGUSR1,
+                  &(struct sigaction){.sa_handler = stats_handler,
+                                      .sa_flags = 0},
+                  NULL)) {
+        log_err("Failed to install signal handler for SIGUSR1");
+        return 0;
+    }
+
+    http_parser_init();
+    http_header_init();
+
+    /* 1. Initialize the listening sockets, one per worker.
+     * With several workers they all bind the same port with SO_REUSEPORT,
+     * and the kernel distributes incoming connections among them. */
+    struct worker *workers = calloc(cfg->workers, sizeof(struct worker));
+    assert(workers && "workers: calloc");
+
+    for (int i = 0; i < cfg->workers; i++) {
+        workers[i].id = i;
+        workers[i].cfg = cfg;
+        workers[i].listenfd = open_listenfd(cfg->port,
+                                           cfg->workers > 1 || cfg->prefork);
+        if (workers[i].listenfd < 0) {
+            log_err("Failed to listen on port %d", cfg->port);
+            return EXIT_FAILURE;
+        }
+
+        int rc UNUSED = sock_set_non_blocking(workers[i].listenfd);
+        assert(rc == 0 && "sock_set_non_blocking");
+    }
+
+    printf("Web server started.\n");
+
+    if (cfg->prefork) {
+        if (prefork_run(workers, cfg->workers) < 0)
+            return EXIT_FAILURE;
+    } else if (cfg->workers == 1) {
+        worker_run(&workers[0]);
+    } else {
+        for (int i = 0; i < cfg->workers; i++) {
+            if (pthread_create(&workers[i].thread, NULL, worker_run,
+                               &workers[i])) {
+                log_err("Failed to create worker thread");
+                return EXIT_FAILURE;
+            }
+        }
+
+        for (int i = 0; i < cfg->workers; i++)
+            pthread_join(workers[i].thread, NULL);
     }
 
+    free(workers);
     free(cfg);
     return 0;
 }
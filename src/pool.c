@@ -0,0 +1,219 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for memfd_create(2) */
+#endif
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "pool.h"
+
+#define CACHE_LINE 64
+
+/**
+ * @brief Maps a slab of POOL_SLAB_SIZE bytes.
+ *
+ * Huge page backed slabs come from the reserved huge page pool if there is
+ * one. Otherwise a slab is aligned on a huge page boundary and marked with
+ * MADV_HUGEPAGE, so the kernel can use a transparent huge page for it.
+ *
+ * @param huge Ask for huge pages.
+ * @param populate Fault the whole slab in now.
+ * @return char* The slab, or NULL on error.
+ */
+static char *slab_map(bool huge, bool populate)
+{
+    int prot = PROT_READ | PROT_WRITE;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    char *slab;
+
+    if (huge) {
+        slab = mmap(NULL, POOL_SLAB_SIZE, prot,
+                    flags | MAP_HUGETLB | (populate ? MAP_POPULATE : 0), -1,
+                    0);
+        if (slab != MAP_FAILED)
+            return slab;
+
+        /* Over-allocate to cut an aligned slab out of the mapping */
+        char *map = mmap(NULL, 2 * POOL_SLAB_SIZE, prot, flags, -1, 0);
+        if (map == MAP_FAILED)
+            return NULL;
+
+        slab = (char *) (((uintptr_t) map + POOL_SLAB_SIZE - 1) &
+                         ~((uintptr_t) POOL_SLAB_SIZE - 1));
+        if (slab > map)
+            munmap(map, slab - map);
+        if (slab + POOL_SLAB_SIZE < map + 2 * POOL_SLAB_SIZE)
+            munmap(slab + POOL_SLAB_SIZE,
+                   map + POOL_SLAB_SIZE - slab);
+        madvise(slab, POOL_SLAB_SIZE, MADV_HUGEPAGE);
+
+        if (populate) {
+            long page = sysconf(_SC_PAGESIZE);
+            for (size_t off = 0; off < POOL_SLAB_SIZE; off += page)
+                slab[off] = 0;
+        }
+        return slab;
+    }
+
+    slab = mmap(NULL, POOL_SLAB_SIZE, prot,
+                flags | (populate ? MAP_POPULATE : 0), -1, 0);
+    return slab == MAP_FAILED ? NULL : slab;
+}
+
+/**
+ * @brief Adds a slab to the pool; its objects are carved out on demand.
+ */
+static int pool_grow(pool_t *p, bool populate)
+{
+    char *slab = slab_map(p->huge, populate);
+    if (!slab)
+        return -1;
+
+    /* The rest of the previous slab (less than one object) is dropped */
+    p->next = slab;
+    p->end = slab + POOL_SLAB_SIZE;
+    p->slabs++;
+    return 0;
+}
+
+/**
+ * @brief Maps the next object of a mirrored pool twice, back to back.
+ *
+ * @return char* The object, or NULL on error.
+ */
+static char *mirror_carve(pool_t *p, bool populate)
+{
+    int prot = PROT_READ | PROT_WRITE;
+    int flags = MAP_SHARED | MAP_FIXED | (populate ? MAP_POPULATE : 0);
+
+    if (p->memfd < 0 || p->memfd_off + p->size > POOL_SLAB_SIZE) {
+        int fd = memfd_create("sehttpd-ring", MFD_CLOEXEC);
+        if (fd < 0)
+            return NULL;
+        if (ftruncate(fd, POOL_SLAB_SIZE) < 0) {
+            close(fd);
+            return NULL;
+        }
+
+        /* The mappings of the previous slab keep its file alive */
+        if (p->memfd >= 0)
+            close(p->memfd);
+        p->memfd = fd;
+        p->memfd_off = 0;
+        p->slabs++;
+    }
+
+    /* Reserve room for both views, then place them in it */
+    char *obj = mmap(NULL, 2 * p->size, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (obj == MAP_FAILED)
+        return NULL;
+
+    if (mmap(obj, p->size, prot, flags, p->memfd, p->memfd_off) ==
+            MAP_FAILED ||
+        mmap(obj + p->size, p->size, prot, flags, p->memfd, p->memfd_off) ==
+            MAP_FAILED) {
+        munmap(obj, 2 * p->size);
+        return NULL;
+    }
+
+    p->memfd_off += p->size;
+    p->total++;
+    return obj;
+}
+
+int pool_init_mirror(pool_t *p, size_t size, size_t prealloc)
+{
+    assert(size % sysconf(_SC_PAGESIZE) == 0 &&
+           "pool_init_mirror: size is not a multiple of the page size");
+    assert(size <= POOL_SLAB_SIZE && "pool_init_mirror: object too large");
+
+    memset(p, 0, sizeof(*p));
+    p->size = size;
+    p->mirror = true;
+    p->memfd = -1;
+
+    for (size_t n = 0; n < prealloc; n++) {
+        char *obj = mirror_carve(p, true);
+        if (!obj) {
+            log_err("Failed to preallocate the pool");
+            return -1;
+        }
+        *(void **) obj = p->free;
+        p->free = obj;
+    }
+    return 0;
+}
+
+int pool_init(pool_t *p, size_t size, size_t prealloc, bool huge)
+{
+    size = (size + CACHE_LINE - 1) & ~((size_t) CACHE_LINE - 1);
+    assert(size <= POOL_SLAB_SIZE && "pool_init: object too large");
+
+    memset(p, 0, sizeof(*p));
+    p->size = size;
+    p->huge = huge;
+    p->memfd = -1;
+
+    size_t per_slab = POOL_SLAB_SIZE / size;
+    for (size_t n = 0; n < prealloc; n += per_slab) {
+        if (pool_grow(p, true) < 0) {
+            log_err("Failed to preallocate the pool");
+            return -1;
+        }
+
+        /* Queue the objects of this slab on the free list */
+        for (; p->next + size <= p->end; p->next += size) {
+            *(void **) p->next = p->free;
+            p->free = p->next;
+            p->total++;
+        }
+    }
+    return 0;
+}
+
+void *pool_alloc(pool_t *p)
+{
+    void *obj = p->free;
+
+    if (obj) {
+        p->free = *(void **) obj;
+    } else if (p->mirror) {
+        if (!(obj = mirror_carve(p, false))) {
+            p->failures++;
+            return NULL;
+        }
+    } else {
+        if (p->next + p->size > p->end && pool_grow(p, false) < 0) {
+            p->failures++;
+            return NULL;
+        }
+        obj = p->next;
+        p->next += p->size;
+        p->total++;
+    }
+
+    if (++p->used > p->peak)
+        p->peak = p->used;
+    return obj;
+}
+
+void pool_free(pool_t *p, void *obj)
+{
+    *(void **) obj = p->free;
+    p->free = obj;
+    p->used--;
+}
+
+void pool_report(const pool_t *p, const char *name)
+{
+    fprintf(stderr,
+            "%s pool: %zu in use, %zu peak, %zu allocated in %zu slabs "
+            "(%zu bytes each), %zu failures\n",
+            name, p->used, p->peak, p->total, p->slabs, p->size, p->failures);
+}
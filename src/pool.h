@@ -0,0 +1,94 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define POOL_SLAB_SIZE (2 << 20) /* One huge page on x86-64 */
+
+/**
+ * @brief A pool of fixed-size objects carved out of large slabs.
+ *
+ * Freed objects are kept on a free list and handed out again, so a busy
+ * pool stops calling the allocator altogether. Slabs are mmap()-ed
+ * POOL_SLAB_SIZE bytes at a time and never returned to the system.
+ *
+ * A pool is not thread-safe; every event loop owns its pools.
+ */
+typedef struct {
+    size_t size;      /* Object size, rounded up to a cache line */
+    bool huge;        /* Back slabs with huge pages */
+
+    void *free;       /* Free list, linked through the objects */
+    char *next;       /* Never used part of the last slab */
+    char *end;        /* End of the last slab */
+
+    /* Mirrored pools only: slabs are memory files rather than mappings */
+    bool mirror;      /* Map every object twice, back to back */
+    int memfd;        /* Memory file of the last slab, or -1 */
+    size_t memfd_off; /* Never used part of the memory file */
+
+    /* Statistics */
+    size_t slabs;     /* Number of slabs mapped */
+    size_t total;     /* Number of objects carved out of the slabs */
+    size_t used;      /* Number of objects currently allocated */
+    size_t peak;      /* Highest value of 'used' */
+    size_t failures;  /* Allocations that failed for lack of memory */
+} pool_t;
+
+/**
+ * @brief Initializes a pool and preallocates objects.
+ *
+ * Preallocated slabs are populated up front, so serving the first
+ * 'prealloc' objects never page faults.
+ *
+ * @param p The pool.
+ * @param size Size of the objects, at most POOL_SLAB_SIZE.
+ * @param prealloc Number of objects to preallocate.
+ * @param huge Back slabs with huge pages: reserved ones (MAP_HUGETLB) if
+ *        available, transparent ones otherwise.
+ * @return int 0 on success, -1 if preallocation failed.
+ */
+int pool_init(pool_t *p, size_t size, size_t prealloc, bool huge);
+
+/**
+ * @brief Initializes a pool of ring buffers and preallocates objects.
+ *
+ * Every object is mapped twice, the second mapping right after the first, so
+ * that the bytes at obj[i] and obj[i + size] are the same memory. Data that
+ * wraps around the end of a ring is thus contiguous in the address space.
+ * Slabs are memfd_create(2) files, carved into 'size' byte pieces that are
+ * mapped when first handed out.
+ *
+ * Every object costs two mappings, never unmapped, so the objects of all
+ * the pools of a process are limited to about half of vm.max_map_count.
+ * Past that, pool_alloc() fails.
+ *
+ * @param p The pool.
+ * @param size Size of the objects, a multiple of the page size.
+ * @param prealloc Number of objects to preallocate.
+ * @return int 0 on success, -1 if preallocation failed.
+ */
+int pool_init_mirror(pool_t *p, size_t size, size_t prealloc);
+
+/**
+ * @brief Allocates an object.
+ *
+ * @return void* The object (uninitialized), or NULL on error.
+ */
+void *pool_alloc(pool_t *p);
+
+/**
+ * @brief Returns an object to its pool.
+ */
+void pool_free(pool_t *p, void *obj);
+
+/**
+ * @brief Prints the occupancy of a pool to stderr.
+ *
+ * @param p The pool.
+ * @param name Name of the pool in the report.
+ */
+void pool_report(const pool_t *p, const char *name);
+
+#endif
@@ -1,255 +1,363 @@
 #include <assert.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/time.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "http.h"
 #include "logger.h"
 #include "timer.h"
 
 #define TIMER_INFINITE (-1)
-#define PQ_DEFAULT_SIZE 10
 
-typedef int (*prio_queue_comparator)(void *pi, void *pj);
+/* The wheel has WHEEL_LEVELS levels of WHEEL_SIZE slots. A slot of level 0
+ * spans one tick (1 ms); a slot of level n spans all the slots of level
+ * n - 1, so the wheel covers 2^24 ms (4.6 hours) ahead. Timers further away
+ * are clamped to the end of the wheel.
+ */
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+#define WHEEL_SPAN ((size_t) 1 << (WHEEL_BITS * WHEEL_LEVELS))
+
+/* Index of the slot of level 'l' that tick 't' falls into */
+#define SLOT(t, l) (((t) >> ((l) *WHEEL_BITS)) & WHEEL_MASK)
 
 /**
- * @brief Priority Queue structure using a binary heap.
+ * @brief Hierarchical timing wheel.
  *
- * Used to efficiently manage timers. The timer with the smallest expiration time
- * is always at the root (index 1).
+ * Arming and disarming a timer are O(1) list operations. Timers due within
+ * WHEEL_SIZE ticks sit in level 0 and expire with their slot; a timer further
+ * away sits in a coarser level and is moved ("cascaded") one level down each
+ * time the wheel reaches its slot, at most WHEEL_LEVELS - 1 times in its
+ * life. Each level keeps a bitmap of its non-empty slots, so the wheel skips
+ * over idle stretches instead of visiting every tick.
+ *
+ * Postponing an armed timer, which every request on a keep-alive connection
+ * does, only updates its key in place: the node stays in its slot and is
+ * moved to the right one when that slot is reached. A busy connection thus
+ * relinks its timer once per timeout period rather than once per request.
  */
 typedef struct {
-    void **priv;                /* Array of pointers to items */
-    size_t nalloc;              /* Number of items currently in the queue */
-    size_t size;                /* Total allocated capacity */
-    prio_queue_comparator comp; /* Comparator function */
-} prio_queue_t;
-
-static bool prio_queue_init(prio_queue_t *ptr,
-                            prio_queue_comparator comp,
-                            size_t size)
+    list_head slots[WHEEL_LEVELS][WHEEL_SIZE];
+    uint64_t busy[WHEEL_LEVELS]; /* Bit i is set if slots[level][i] is used */
+    size_t next;                 /* Next tick to process */
+    size_t count;                /* Number of armed timers */
+} timer_wheel_t;
+
+/* Every event loop (worker thread) has its own timer wheel and clock */
+static __thread timer_wheel_t wheel;
+static __thread size_t current_msec;
+
+/* timerfd backend: the descriptor, or -1 when epoll_wait times out instead,
+ * and the tick it is armed for, or 0 */
+static __thread int timerfd = -1;
+static __thread size_t timerfd_deadline;
+
+void time_update()
 {
-    /* Allocate memory for 'size + 1' items because binary heap uses 1-based indexing */
-    ptr->priv = malloc(sizeof(void *) * (size + 1));
-    if (!ptr->priv) {
-        log_err("prio_queue_init: malloc failed");
-        return false;
-    }
-
-    ptr->nalloc = 0;
-    ptr->size = size + 1;
-    ptr->comp = comp;
-    return true;
+    struct timespec ts;
+    int rc UNUSED = clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    assert(rc == 0 && "time_update: clock_gettime error");
+    current_msec = ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-static inline bool prio_queue_is_empty(prio_queue_t *ptr)
+/**
+ * @brief Finds the slot a timer expiring at 'key' belongs to.
+ */
+static void wheel_locate(size_t key, int *level, int *slot)
 {
-    return ptr->nalloc == 0;
+    /* Overdue timers expire on the next tick */
+    if (key < wheel.next)
+        key = wheel.next;
+    if (key - wheel.next >= WHEEL_SPAN)
+        key = wheel.next + WHEEL_SPAN - 1;
+
+    /* The level is the first one whose slots reach 'key' */
+    int l = 0;
+    size_t delta = key - wheel.next;
+    while (delta >= (size_t) 1 << ((l + 1) * WHEEL_BITS))
+        l++;
+
+    *level = l;
+    *slot = SLOT(key, l);
 }
 
-static inline size_t prio_queue_size(prio_queue_t *ptr)
+/**
+ * @brief Links a node into the slot matching its expiration time.
+ */
+static void wheel_insert(timer_node *node)
 {
-    return ptr->nalloc;
+    int level, slot;
+
+    wheel_locate(node->key, &level, &slot);
+    list_add_tail(&node->link, &wheel.slots[level][slot]);
+    wheel.busy[level] |= (uint64_t) 1 << slot;
 }
 
-static inline void *prio_queue_min(prio_queue_t *ptr)
+/**
+ * @brief Unlinks a node from its slot.
+ */
+static void wheel_remove(timer_node *node)
 {
-    return prio_queue_is_empty(ptr) ? NULL : ptr->priv[1];
+    list_head *prev = node->link.prev;
+    list_del(&node->link);
+    timer_node_init(node);
+
+    /* Clear the busy bit if that was the last node of the slot, which is
+     * then linked to itself */
+    if (prev->next == prev && prev->prev == prev) {
+        for (int l = 0; l < WHEEL_LEVELS; l++) {
+            list_head *base = wheel.slots[l];
+            if (prev >= base && prev < base + WHEEL_SIZE) {
+                wheel.busy[l] &= ~((uint64_t) 1 << (prev - base));
+                break;
+            }
+        }
+    }
 }
 
-static bool resize(prio_queue_t *ptr, size_t new_size)
+/**
+ * @brief Moves the timers of a slot into the levels below.
+ */
+static void wheel_cascade(int level, int slot)
 {
-    if (new_size <= ptr->nalloc) {
-        log_err("resize: new_size to small");
-        return false;
-    }
+    list_head *head = &wheel.slots[level][slot], *pos, *n;
 
-    /* TODO: use memory pool to avoid unexpected fragmentation */
-    void **new_ptr = malloc(sizeof(void *) * new_size);
-    if (!new_ptr) {
-        log_err("resize: malloc failed");
-        return false;
+    wheel.busy[level] &= ~((uint64_t) 1 << slot);
+    list_for_each_safe (pos, n, head) {
+        list_del(pos);
+        wheel_insert(list_entry(pos, timer_node, link));
     }
-
-    memcpy(new_ptr, ptr->priv, sizeof(void *) * (ptr->nalloc + 1));
-    free(ptr->priv);
-    ptr->priv = new_ptr;
-    ptr->size = new_size;
-    return true;
+    INIT_LIST_HEAD(head);
 }
 
-static inline void swap(prio_queue_t *ptr, size_t i, size_t j)
+/**
+ * @brief Returns the distance from 'from' to the first busy slot at or after
+ * it, wrapping around, or WHEEL_SIZE if the level is empty.
+ */
+static int wheel_scan(uint64_t busy, int from)
 {
-    void *tmp = ptr->priv[i];
-    ptr->priv[i] = ptr->priv[j];
-    ptr->priv[j] = tmp;
+    if (!busy)
+        return WHEEL_SIZE;
+    uint64_t rotated = (busy >> from) | (from ? busy << (WHEEL_SIZE - from) : 0);
+    return __builtin_ctzll(rotated);
 }
 
-/* "Swim" (percolate up) operation to restore heap property after insertion */
-static inline void swim(prio_queue_t *ptr, size_t k)
+int timer_init()
 {
-    while (k > 1 && ptr->comp(ptr->priv[k], ptr->priv[k / 2])) {
-        swap(ptr, k, k / 2);
-        k /= 2;
+    for (int l = 0; l < WHEEL_LEVELS; l++) {
+        for (int i = 0; i < WHEEL_SIZE; i++)
+            INIT_LIST_HEAD(&wheel.slots[l][i]);
+        wheel.busy[l] = 0;
     }
+    wheel.count = 0;
+
+    time_update();
+    wheel.next = current_msec;
+    return 0;
 }
 
-/* "Sink" (percolate down) operation to restore heap property after deletion */
-static size_t sink(prio_queue_t *ptr, size_t k)
+int timer_fd_init()
 {
-    size_t nalloc = ptr->nalloc;
-
-    while (2 * k <= nalloc) {
-        size_t j = 2 * k;
-        /* Choose the smaller of the two children */
-        if (j < nalloc && ptr->comp(ptr->priv[j + 1], ptr->priv[j]))
-            j++;
-        /* If parent is already smaller than children, stop */
-        if (!ptr->comp(ptr->priv[j], ptr->priv[k]))
-            break;
-        swap(ptr, j, k);
-        k = j;
-    }
-
-    return k;
+    timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timerfd < 0)
+        log_err("timerfd_create");
+    timerfd_deadline = 0;
+    return timerfd;
 }
 
-/* remove the item with minimum key value from the heap */
-static bool prio_queue_delmin(prio_queue_t *ptr)
+/**
+ * @brief Arms the timerfd to expire at tick 'when', unless it already is.
+ */
+static void timer_fd_arm(size_t when)
 {
-    if (prio_queue_is_empty(ptr))
-        return true;
-
-    /* Move the last item to the root and sink it down */
-    swap(ptr, 1, ptr->nalloc);
-    ptr->nalloc--;
-    sink(ptr, 1);
-
-    /* Shrink the array if it's too empty to save memory */
-    if (ptr->nalloc > 0 && ptr->nalloc <= (ptr->size - 1) / 4) {
-        if (!resize(ptr, ptr->size / 2))
-            return false;
+    if (when == timerfd_deadline)
+        return;
+
+    struct itimerspec its = {
+        .it_value.tv_sec = when / 1000,
+        .it_value.tv_nsec = (when % 1000) * 1000000,
+    };
+    if (timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+        log_err("timerfd_settime");
+        return;
     }
-    return true;
+    timerfd_deadline = when;
 }
 
-/* add a new item to the heap */
-static bool prio_queue_insert(prio_queue_t *ptr, void *item)
+void timer_fd_handle()
 {
-    if (ptr->nalloc + 1 == ptr->size) {
-        if (!resize(ptr, ptr->size * 2))
-            return false;
-    }
-
-    ptr->priv[++ptr->nalloc] = item;
-    swim(ptr, ptr->nalloc);
-    return true;
+    uint64_t expirations;
+    if (read(timerfd, &expirations, sizeof(expirations)) < 0)
+        return;
+
+    /* The coarse clock may lag behind the timerfd by up to a jiffy. The
+     * deadline is known to have passed, so expire what is due without
+     * waiting for the clock to catch up. */
+    if (current_msec < timerfd_deadline)
+        current_msec = timerfd_deadline;
+    timerfd_deadline = 0;
 }
 
-static int timer_comp(void *ti, void *tj)
+int find_timer()
 {
-    return ((timer_node *) ti)->key < ((timer_node *) tj)->key ? 1 : 0;
-}
+    if (wheel.count == 0)
+        return TIMER_INFINITE;
+
+    /* Level 0: the first slot due. When it is empty, nothing is due before
+     * a slot of an upper level is cascaded. */
+    size_t when = SIZE_MAX;
+    if (wheel.busy[0])
+        when = wheel.next + wheel_scan(wheel.busy[0], SLOT(wheel.next, 0));
+
+    /* Upper levels: the first slot to be cascaded. Unless the wheel stands
+     * right at the start of a slot, the current slot of a level was
+     * cascaded already and its timers are a full turn away. */
+    for (int l = 1; l < WHEEL_LEVELS; l++) {
+        if (!wheel.busy[l])
+            continue;
+        int shift = l * WHEEL_BITS;
+        size_t first = (wheel.next + ((size_t) 1 << shift) - 1) >> shift;
+        int d = wheel_scan(wheel.busy[l], first & WHEEL_MASK);
+        size_t tick = (first + d) << shift;
+        if (tick < when)
+            when = tick;
+    }
 
-static prio_queue_t timer;
-static size_t current_msec;
+    if (timerfd >= 0) {
+        timer_fd_arm(when);
+        return TIMER_INFINITE;
+    }
 
-static void time_update()
-{
-    struct timeval tv;
-    int rc UNUSED = gettimeofday(&tv, NULL);
-    assert(rc == 0 && "time_update: gettimeofday error");
-    current_msec = tv.tv_sec * 1000 + tv.tv_usec / 1000;
+    return when > current_msec ? (int) (when - current_msec) : 0;
 }
 
-int timer_init()
+void handle_expired_timers()
 {
-    bool ret UNUSED = prio_queue_init(&timer, timer_comp, PQ_DEFAULT_SIZE);
-    assert(ret && "prio_queue_init error");
+    while (wheel.next <= current_msec) {
+        if (wheel.count == 0) {
+            wheel.next = current_msec + 1;
+            break;
+        }
 
-    time_update();
-    return 0;
-}
+        /* Entering a new turn of a level: bring the timers of the next slot
+         * of the level above down */
+        for (int l = 1; l < WHEEL_LEVELS; l++) {
+            if (wheel.next & (((size_t) 1 << (l * WHEEL_BITS)) - 1))
+                break;
+            wheel_cascade(l, SLOT(wheel.next, l));
+        }
 
-int find_timer()
-{
-    int time = TIMER_INFINITE;
-
-    while (!prio_queue_is_empty(&timer)) {
-        time_update();
-        timer_node *node = prio_queue_min(&timer);
-        assert(node && "prio_queue_min error");
-
-        /* Lazy deletion handling:
-         * If the timer at the top is marked as deleted, remove it and check the next one.
-         */
-        if (node->deleted) {
-            bool ret UNUSED = prio_queue_delmin(&timer);
-            assert(ret && "prio_queue_delmin");
-            free(node);
-            continue;
+        /* Expire the current slot as a batch. Callbacks may disarm other
+         * timers, so nodes are unlinked one at a time. */
+        int slot = SLOT(wheel.next, 0);
+        list_head *head = &wheel.slots[0][slot];
+        while (!list_empty(head)) {
+            timer_node *node = list_entry(head->next, timer_node, link);
+            wheel_remove(node);
+
+            /* Postponed after it was linked here, move it to its slot now */
+            if (node->key > wheel.next) {
+                wheel_insert(node);
+                continue;
+            }
+            wheel.count--;
+
+            http_request_t *req = container_of(node, http_request_t, timer);
+            if (node->callback)
+                node->callback(req);
         }
 
-        time = (int) (node->key - current_msec);
-        time = (time > 0 ? time : 0);
-        break;
+        /* Skip to the next busy slot of level 0 or the end of this turn, but
+         * not past the current time, so that new timers are not delayed */
+        int d = wheel_scan(wheel.busy[0] & (~(uint64_t) 0 << slot), slot);
+        if (d == 0 || slot + d > WHEEL_SIZE)
+            d = WHEEL_SIZE - slot;
+        wheel.next += d;
+        if (wheel.next > current_msec + 1)
+            wheel.next = current_msec + 1;
     }
 
-    return time;
+    debug("handle_expired_timers, armed = %zu", wheel.count);
 }
 
-void handle_expired_timers()
+bool expire_oldest_timer(size_t ahead, timer_filter filter)
 {
-    bool ret UNUSED;
-
-    while (!prio_queue_is_empty(&timer)) {
-        debug("handle_expired_timers, size = %zu", prio_queue_size(&timer));
-        time_update();
-        timer_node *node = prio_queue_min(&timer);
-        assert(node && "prio_queue_min error");
-
-        if (node->deleted) {
-            ret = prio_queue_delmin(&timer);
-            assert(ret && "handle_expired_timers: prio_queue_delmin error");
-            free(node);
+    for (int l = 0; l < WHEEL_LEVELS; l++) {
+        if (!wheel.busy[l])
             continue;
-        }
-
-        /* If the earliest timer hasn't expired yet, we are done */
-        if (node->key > current_msec)
-            return;
-
-        /* Execute the callback (e.g., close the connection) */
-        if (node->callback)
-            node->callback(node->request);
 
-        ret = prio_queue_delmin(&timer);
-        assert(ret && "handle_expired_timers: prio_queue_delmin error");
-        free(node);
+        /* Visit the slots of the level in the order they come due */
+        int shift = l * WHEEL_BITS;
+        size_t first = (wheel.next + ((size_t) 1 << shift) - 1) >> shift;
+        for (int d = 0; d < WHEEL_SIZE; d++) {
+            int slot = (first + d) & WHEEL_MASK;
+            list_head *head = &wheel.slots[l][slot];
+            size_t end = (first + d + 1) << shift;
+
+            /* Nodes are in arming order; skip the postponed ones by moving
+             * them to their slot, as the slot expiring would, and leave
+             * the ones the filter passes over where they are */
+            list_head *pos, *n;
+            list_for_each_safe (pos, n, head) {
+                timer_node *node = list_entry(pos, timer_node, link);
+                if (node->key >= end) {
+                    wheel_remove(node);
+                    wheel_insert(node);
+                    continue;
+                }
+
+                http_request_t *req = container_of(node, http_request_t, timer);
+                if (filter && !filter(req))
+                    continue;
+                if (node->key > current_msec &&
+                    node->key - current_msec > ahead)
+                    return false;
+
+                wheel_remove(node);
+                wheel.count--;
+                if (node->callback)
+                    node->callback(req);
+                return true;
+            }
+        }
     }
+    return false;
 }
 
 void add_timer(http_request_t *req, size_t timeout, timer_callback cb)
 {
-    timer_node *node = malloc(sizeof(timer_node));
-    assert(node && "add_timer: malloc error");
-
-    time_update();
-    req->timer = node;
-    node->key = current_msec + timeout;
-    node->deleted = false;
+    timer_node *node = &req->timer;
+    size_t key = current_msec + timeout;
     node->callback = cb;
-    node->request = req;
 
-    bool ret UNUSED = prio_queue_insert(&timer, node);
-    assert(ret && "add_timer: prio_queue_insert error");
+    if (!list_empty(&node->link)) {
+        /* Already armed: a later expiration is recorded in place, the node
+         * is moved when its current slot is reached */
+        if (key >= node->key) {
+            node->key = key;
+            return;
+        }
+        wheel_remove(node);
+        wheel.count--;
+    }
+
+    node->key = key;
+    wheel_insert(node);
+    wheel.count++;
 }
 
 void del_timer(http_request_t *req)
 {
-    time_update();
-    timer_node *node = req->timer;
-    assert(node && "del_timer: req->timer is NULL");
+    timer_node *node = &req->timer;
+
+    if (list_empty(&node->link))
+        return;
 
-    /* Lazy deletion: Just mark it. It will be removed later. */
-    node->deleted = true;
+    wheel_remove(node);
+    wheel.count--;
 }
@@ -2,61 +2,123 @@
 #define TIMER_H
 
 #include <stdbool.h>
-#include "http.h"
+#include <stddef.h>
+
+#include "list.h"
 
 #define TIMEOUT_DEFAULT 500 /* ms */
+#define TIMEOUT_MIN 50      /* ms, keep-alive timeout at the connection limit */
+#define TIMEOUT_SEND 10000  /* ms, a response may make no progress this long */
+
+struct http_request;
 
-typedef int (*timer_callback)(http_request_t *req);
+typedef int (*timer_callback)(struct http_request *req);
+typedef bool (*timer_filter)(struct http_request *req);
 
 /**
  * @brief Represents a timer event.
+ *
+ * The node is embedded in the request it belongs to, so arming a timer never
+ * allocates memory.
  */
 typedef struct {
-    size_t key;             /* Expiration time (in milliseconds) */
-    bool deleted;           /* Lazy deletion flag. If true, this timer is ignored. */
-    timer_callback callback;/* Function to call when timer expires */
-    http_request_t *request;/* Argument to pass to the callback */
+    list_head link;          /* Slot of the timing wheel; empty if not armed */
+    size_t key;              /* Expiration time (in milliseconds) */
+    timer_callback callback; /* Function to call when timer expires */
 } timer_node;
 
 /**
- * @brief Initializes the timer subsystem (priority queue).
+ * @brief Initializes a timer node as not armed.
+ */
+static inline void timer_node_init(timer_node *node)
+{
+    INIT_LIST_HEAD(&node->link);
+}
+
+/**
+ * @brief Initializes the timer subsystem (timing wheel).
  * @return int 0 on success.
  */
 int timer_init();
 
 /**
- * @brief Finds the time until the next timer expires.
+ * @brief Refreshes the clock of the calling event loop.
+ *
+ * Timers read a cached CLOCK_MONOTONIC_COARSE clock, which wall-clock
+ * adjustments do not affect. The event loop refreshes it once every time
+ * epoll_wait returns rather than on every timer operation.
+ */
+void time_update();
+
+/**
+ * @brief Switches the timers of the calling event loop to a timerfd(2).
+ *
+ * Instead of bounding the epoll_wait timeout, the wheel then programs a
+ * timerfd to its next deadline, which wakes the loop exactly at the tick it
+ * is set for. The timerfd is only reprogrammed when that deadline changes, so
+ * timers sharing a slot share a single wakeup.
+ *
+ * @return int The timerfd to poll for EPOLLIN, or -1 on error.
+ */
+int timer_fd_init();
+
+/**
+ * @brief Acknowledges an expiration of the timerfd.
  *
- * Used to determine the timeout for epoll_wait.
+ * Called when the descriptor returned by timer_fd_init() is readable, before
+ * handle_expired_timers().
+ */
+void timer_fd_handle();
+
+/**
+ * @brief Finds the time until the timing wheel needs to run next.
+ *
+ * Used to determine the timeout for epoll_wait. Far away timers wait in the
+ * coarse levels of the wheel, so the wheel may ask to be woken up before
+ * they expire to move them into finer slots. With the timerfd backend, the
+ * timerfd is armed for that time instead.
  *
- * @return int Time in milliseconds, or -1 (infinite) if no timers.
+ * @return int Time in milliseconds, or -1 (infinite) if no timers or if the
+ *         timerfd backend is used.
  */
 int find_timer();
 
 /**
- * @brief Processes and removes all expired timers.
+ * @brief Runs the callbacks of all expired timers.
  *
- * Checks the priority queue for timers with key <= current_time.
+ * Advances the wheel up to the current time, expiring a whole slot at a time.
  */
 void handle_expired_timers();
 
 /**
- * @brief Adds a new timer.
+ * @brief Runs the callback of the timer due first, ahead of time.
+ *
+ * Used to close the connection idle for the longest time when a worker has
+ * too many connections open.
+ *
+ * @param ahead Only expire the timer if it is due within 'ahead' ms.
+ * @param filter Timers of requests it returns false for are passed over;
+ *        NULL to consider every timer.
+ * @return bool False if no timer is armed, considered or due soon enough.
+ */
+bool expire_oldest_timer(size_t ahead, timer_filter filter);
+
+/**
+ * @brief Arms the timer of a request, or re-arms it if it is already armed.
+ *
+ * Re-arming a timer to expire later is done in place, without relinking.
  *
  * @param req The request associated with this timer.
  * @param timeout Timeout duration in milliseconds.
  * @param cb Callback function to execute on expiration.
  */
-void add_timer(http_request_t *req, size_t timeout, timer_callback cb);
+void add_timer(struct http_request *req, size_t timeout, timer_callback cb);
 
 /**
- * @brief "Deletes" a timer.
- *
- * Note: This marks the timer as deleted (lazy deletion). It will be removed
- * from the queue when it reaches the top or during cleanup.
+ * @brief Disarms the timer of a request, if it is armed.
  *
  * @param req The request whose timer should be deleted.
  */
-void del_timer(http_request_t *req);
+void del_timer(struct http_request *req);
 
 #endif
@@ -0,0 +1,279 @@
+/**
+ * uring.c - Minimal io_uring(7) support.
+ *
+ * The server talks to io_uring through the raw system calls rather than
+ * liburing, which it would otherwise need as a build dependency. Only what
+ * the event loops use is covered: a ring whose queues are mapped at once
+ * (IORING_FEAT_SINGLE_MMAP), submission with a bounded wait
+ * (IORING_FEAT_EXT_ARG), rings of provided buffers, fixed files and a
+ * completion eventfd.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "uring.h"
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd,
+                              unsigned to_submit,
+                              unsigned min_complete,
+                              unsigned flags,
+                              const void *arg,
+                              size_t argsz)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                   arg, argsz);
+}
+
+static int sys_io_uring_register(int fd,
+                                 unsigned opcode,
+                                 const void *arg,
+                                 unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+int uring_init(uring_t *u, unsigned entries, unsigned flags)
+{
+    struct io_uring_params p;
+
+    memset(u, 0, sizeof(*u));
+    memset(&p, 0, sizeof(p));
+    p.flags = flags;
+    u->fd = sys_io_uring_setup(entries, &p);
+    if (u->fd < 0 && errno == EINVAL && flags) {
+        memset(&p, 0, sizeof(p));
+        u->fd = sys_io_uring_setup(entries, &p);
+    }
+    if (u->fd < 0)
+        return -1;
+
+    u->features = p.features;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(p.features & IORING_FEAT_EXT_ARG)) {
+        close(u->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    u->ring = mmap(NULL, u->ring_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->ring == MAP_FAILED)
+        goto err;
+
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        munmap(u->ring, u->ring_size);
+        goto err;
+    }
+
+    char *ring = u->ring;
+    u->sq_head = (unsigned *) (ring + p.sq_off.head);
+    u->sq_tail = (unsigned *) (ring + p.sq_off.tail);
+    u->sq_mask = (unsigned *) (ring + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *) (ring + p.sq_off.array);
+    u->sq_entries = p.sq_entries;
+    u->sqe_tail = *u->sq_tail;
+
+    u->cq_head = (unsigned *) (ring + p.cq_off.head);
+    u->cq_tail = (unsigned *) (ring + p.cq_off.tail);
+    u->cq_mask = (unsigned *) (ring + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *) (ring + p.cq_off.cqes);
+
+    /* Entry i of the submission queue always holds request i */
+    for (unsigned i = 0; i < p.sq_entries; i++)
+        u->sq_array[i] = i;
+    return 0;
+
+err:
+    close(u->fd);
+    return -1;
+}
+
+void uring_exit(uring_t *u)
+{
+    munmap(u->sqes, u->sqes_size);
+    munmap(u->ring, u->ring_size);
+    close(u->fd);
+}
+
+/**
+ * @brief Hands the prepared requests to the kernel.
+ *
+ * @param u The ring.
+ * @param min_complete Number of completions to wait for.
+ * @param timeout Time to wait in milliseconds, -1 for no limit.
+ * @return int Number of requests submitted, or -1 on error.
+ */
+static int uring_enter(uring_t *u, unsigned min_complete, int timeout)
+{
+    unsigned to_submit = u->sqe_tail - *u->sq_tail;
+    unsigned flags = 0;
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg = {
+        .sigmask_sz = _NSIG / 8,
+    };
+
+    __atomic_store_n(u->sq_tail, u->sqe_tail, __ATOMIC_RELEASE);
+
+    if (min_complete) {
+        flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        if (timeout >= 0) {
+            ts.tv_sec = timeout / 1000;
+            ts.tv_nsec = (long long) (timeout % 1000) * 1000000;
+            arg.ts = (uintptr_t) &ts;
+        }
+    } else if (!to_submit) {
+        return 0;
+    }
+
+    int n = sys_io_uring_enter(u->fd, to_submit, min_complete, flags,
+                               min_complete ? &arg : NULL,
+                               min_complete ? sizeof(arg) : 0);
+    if (n < 0) {
+        /* Requests stay queued when the wait is cut short */
+        if (errno == ETIME || errno == EINTR)
+            return 0;
+        log_err("io_uring_enter");
+        return -1;
+    }
+    return n;
+}
+
+int uring_reserve(uring_t *u, unsigned n)
+{
+    unsigned used = u->sqe_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    if (used + n <= u->sq_entries)
+        return 0;
+    return uring_enter(u, 0, 0) < 0 ? -1 : 0;
+}
+
+struct io_uring_sqe *uring_get_sqe(uring_t *u)
+{
+    if (uring_reserve(u, 1) < 0)
+        return NULL;
+
+    struct io_uring_sqe *sqe = &u->sqes[u->sqe_tail & *u->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sqe_tail++;
+    return sqe;
+}
+
+int uring_submit(uring_t *u)
+{
+    return uring_enter(u, 0, 0);
+}
+
+int uring_wait(uring_t *u, int timeout)
+{
+    /* Completions already posted need no wait */
+    int wait = !uring_peek(u);
+    return uring_enter(u, wait, timeout) < 0 ? -1 : 0;
+}
+
+int uring_register_eventfd(uring_t *u, int efd)
+{
+    int rc = sys_io_uring_register(u->fd, IORING_REGISTER_EVENTFD, &efd, 1);
+    return rc < 0 ? -1 : 0;
+}
+
+int uring_register_files(uring_t *u, unsigned n)
+{
+    int *fds = malloc(n * sizeof(int));
+    if (!fds)
+        return -1;
+
+    /* A slot holding -1 is empty */
+    for (unsigned i = 0; i < n; i++)
+        fds[i] = -1;
+    int rc = sys_io_uring_register(u->fd, IORING_REGISTER_FILES, fds, n);
+    free(fds);
+    return rc < 0 ? -1 : 0;
+}
+
+int uring_update_file(uring_t *u, unsigned slot, int fd)
+{
+    struct io_uring_files_update up = {
+        .offset = slot,
+        .fds = (uintptr_t) &fd,
+    };
+    int rc = sys_io_uring_register(u->fd, IORING_REGISTER_FILES_UPDATE, &up, 1);
+    return rc < 0 ? -1 : 0;
+}
+
+int uring_bufs_init(uring_t *u,
+                    uring_bufs_t *b,
+                    uint16_t bgid,
+                    unsigned nbufs,
+                    unsigned size)
+{
+    size_t ring_size = nbufs * sizeof(struct io_uring_buf);
+    size_t total = ring_size + (size_t) nbufs * size;
+
+    /* The ring of buffer descriptors must be page aligned */
+    char *mem = mmap(NULL, total, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+        return -1;
+
+    struct io_uring_buf_reg reg = {
+        .ring_addr = (uintptr_t) mem,
+        .ring_entries = nbufs,
+        .bgid = bgid,
+    };
+    if (sys_io_uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        munmap(mem, total);
+        return -1;
+    }
+
+    b->br = (struct io_uring_buf_ring *) mem;
+    b->bufs = mem + ring_size;
+    b->nbufs = nbufs;
+    b->size = size;
+    b->bgid = bgid;
+    b->tail = 0;
+
+    for (unsigned i = 0; i < nbufs; i++) {
+        struct io_uring_buf *buf = &b->br->bufs[i];
+        buf->addr = (uintptr_t) (b->bufs + (size_t) i * size);
+        buf->len = size;
+        buf->bid = i;
+    }
+    b->tail = nbufs;
+    __atomic_store_n(&b->br->tail, b->tail, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void uring_bufs_exit(uring_bufs_t *b)
+{
+    size_t ring_size = b->nbufs * sizeof(struct io_uring_buf);
+    munmap(b->br, ring_size + (size_t) b->nbufs * b->size);
+}
+
+void uring_buf_recycle(uring_bufs_t *b, unsigned flags)
+{
+    unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+    struct io_uring_buf *buf = &b->br->bufs[b->tail & (b->nbufs - 1)];
+
+    buf->addr = (uintptr_t) (b->bufs + (size_t) bid * b->size);
+    buf->len = b->size;
+    buf->bid = bid;
+    b->tail++;
+    __atomic_store_n(&b->br->tail, b->tail, __ATOMIC_RELEASE);
+}
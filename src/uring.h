@@ -0,0 +1,204 @@
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief An io_uring(7) instance.
+ *
+ * A thin wrapper around the raw system calls: the rings are mapped into the
+ * process, requests are prepared in place in the submission queue and all of
+ * them are handed to the kernel by the next uring_submit() or uring_wait().
+ *
+ * A ring is not thread-safe; every event loop owns its rings.
+ */
+typedef struct {
+    int fd;
+    unsigned features;     /* IORING_FEAT_* reported by the kernel */
+
+    /* Submission queue */
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned sq_entries;
+    unsigned sqe_tail;     /* Requests prepared, published by a submission */
+    struct io_uring_sqe *sqes;
+
+    /* Completion queue */
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *ring;            /* Mapping of both queues */
+    size_t ring_size;
+    size_t sqes_size;
+} uring_t;
+
+/**
+ * @brief A ring of buffers provided to the kernel (IORING_REGISTER_PBUF_RING).
+ *
+ * Receive requests posted with IOSQE_BUFFER_SELECT take a buffer only when
+ * data arrives, so waiting connections hold no memory.
+ */
+typedef struct {
+    struct io_uring_buf_ring *br;
+    char *bufs;            /* 'nbufs' buffers of 'size' bytes */
+    unsigned nbufs, size;
+    uint16_t bgid;         /* Buffer group of the ring */
+    uint16_t tail;         /* Local copy of the tail of the ring */
+} uring_bufs_t;
+
+/**
+ * @brief Sets up a ring.
+ *
+ * Kernels that reject 'flags' get a ring set up without them. The kernel
+ * must map both queues at once and take a timeout when waiting
+ * (Linux 5.11).
+ *
+ * @param u The ring.
+ * @param entries Size of the submission queue, a power of two.
+ * @param flags IORING_SETUP_* flags to try first.
+ * @return int 0 on success, -1 on error.
+ */
+int uring_init(uring_t *u, unsigned entries, unsigned flags);
+
+/**
+ * @brief Tears a ring down, dropping any request not submitted yet.
+ */
+void uring_exit(uring_t *u);
+
+/**
+ * @brief Makes sure 'n' requests can be prepared without an intervening
+ * submission, submitting those already prepared if needed.
+ *
+ * Requests linked with IOSQE_IO_LINK must be submitted together.
+ *
+ * @return int 0 on success, -1 on error.
+ */
+int uring_reserve(uring_t *u, unsigned n);
+
+/**
+ * @brief Takes an entry of the submission queue.
+ *
+ * A full queue is submitted first.
+ *
+ * @return struct io_uring_sqe* The zeroed entry, or NULL on error.
+ */
+struct io_uring_sqe *uring_get_sqe(uring_t *u);
+
+/**
+ * @brief Submits the prepared requests without waiting.
+ *
+ * @return int Number of requests submitted, or -1 on error.
+ */
+int uring_submit(uring_t *u);
+
+/**
+ * @brief Submits the prepared requests and waits for a completion.
+ *
+ * @param u The ring.
+ * @param timeout Time to wait in milliseconds, -1 for no limit.
+ * @return int 0 on a completion, a timeout or a signal, -1 on error.
+ */
+int uring_wait(uring_t *u, int timeout);
+
+/**
+ * @brief Returns the oldest completion not consumed yet.
+ *
+ * @return struct io_uring_cqe* The completion, or NULL if there is none.
+ */
+static inline struct io_uring_cqe *uring_peek(uring_t *u)
+{
+    unsigned head = *u->cq_head;
+    if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &u->cqes[head & *u->cq_mask];
+}
+
+/**
+ * @brief Consumes the completion returned by uring_peek(), whose slot may
+ * then be reused by the kernel.
+ */
+static inline void uring_advance(uring_t *u)
+{
+    __atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Registers an eventfd the kernel signals on every completion.
+ *
+ * @return int 0 on success, -1 on error.
+ */
+int uring_register_eventfd(uring_t *u, int efd);
+
+/**
+ * @brief Registers a table of 'n' empty fixed file slots.
+ *
+ * @return int 0 on success, -1 on error.
+ */
+int uring_register_files(uring_t *u, unsigned n);
+
+/**
+ * @brief Stores 'fd' in a fixed file slot, or empties the slot if 'fd' is -1.
+ *
+ * Requests in flight keep using the file they were submitted with.
+ *
+ * @return int 0 on success, -1 on error.
+ */
+int uring_update_file(uring_t *u, unsigned slot, int fd);
+
+/**
+ * @brief Allocates buffers and provides them to the kernel (Linux 5.19).
+ *
+ * @param u The ring.
+ * @param b The buffer ring.
+ * @param bgid Buffer group requests select buffers from.
+ * @param nbufs Number of buffers, a power of two.
+ * @param size Size of a buffer.
+ * @return int 0 on success, -1 on error.
+ */
+int uring_bufs_init(uring_t *u,
+                    uring_bufs_t *b,
+                    uint16_t bgid,
+                    unsigned nbufs,
+                    unsigned size);
+
+/**
+ * @brief Frees the buffers of a buffer ring. The ring it was registered
+ * with must be torn down or stop using it.
+ */
+void uring_bufs_exit(uring_bufs_t *b);
+
+/**
+ * @brief Returns the buffer a completion carries data in.
+ */
+static inline char *uring_buf(const uring_bufs_t *b, unsigned flags)
+{
+    return b->bufs + (size_t) (flags >> IORING_CQE_BUFFER_SHIFT) * b->size;
+}
+
+/**
+ * @brief Gives the buffer a completion carried data in back to the kernel.
+ */
+void uring_buf_recycle(uring_bufs_t *b, unsigned flags);
+
+/* Completions are told apart by 'user_data': a pointer to the object the
+ * request belongs to, whose low bits hold the kind of request. Objects are
+ * at least 8-byte aligned. */
+#define URING_OP_MASK 7
+
+static inline uint64_t uring_data(const void *ptr, unsigned op)
+{
+    return (uintptr_t) ptr | op;
+}
+
+static inline void *uring_ptr(uint64_t data)
+{
+    return (void *) (uintptr_t) (data & ~(uint64_t) URING_OP_MASK);
+}
+
+static inline unsigned uring_op(uint64_t data)
+{
+    return data & URING_OP_MASK;
+}
+
+#endif
@@ -0,0 +1,119 @@
+/* The lookup table and its helpers are static, so the module is built into
+ * this program, first so that it sets its feature macros */
+#include "../src/http_request.c"
+
+#include <ctype.h>
+
+#include "test.h"
+
+/* Folding 8 bytes at once lowers ASCII letters only, whatever byte is at
+ * whatever position */
+static void test_fold()
+{
+    for (int pos = 0; pos < 8; pos++) {
+        for (int c = 0; c < 256; c++) {
+            for (int fill = 0; fill < 256; fill += 0x41) {
+                uint8_t in[8], out[8];
+                memset(in, fill, 8);
+                in[pos] = c;
+                uint64_t x;
+                memcpy(&x, in, 8);
+                x = fold8(x);
+                memcpy(out, &x, 8);
+                for (int i = 0; i < 8; i++)
+                    CHECK(out[i] == (in[i] >= 'A' && in[i] <= 'Z'
+                                         ? in[i] | 0x20
+                                         : in[i]));
+            }
+        }
+    }
+}
+
+/* Runs the handlers for one header line "key: value" and returns the
+ * response they set up */
+static http_out_t handle(const char *key, const char *value, time_t mtime)
+{
+    static char line[256];
+    http_request_t r;
+    http_out_t o = {.fd = -1, .mtime = mtime, .modified = true};
+
+    init_http_request(&r, -1, -1, NULL);
+    size_t klen = strlen(key);
+    snprintf(line, sizeof(line), "%s: %s\r\n", key, value);
+
+    http_header_t *hd = http_header_alloc(&r);
+    CHECK(hd);
+    hd->key_start = line;
+    hd->key_end = line + klen;
+    hd->value_start = line + klen + 2;
+    hd->value_end = line + klen + 2 + strlen(value);
+    list_add(&hd->list, &r.list);
+
+    http_handle_header(&r, &o);
+    CHECK(list_empty(&r.list));
+    return o;
+}
+
+/* Header names match whole and in any case; other names that share their
+ * length, ends or prefix do not */
+static void test_lookup()
+{
+    static const struct {
+        const char *key;
+        bool match;
+    } names[] = {
+        {"Connection", true},    {"connection", true},
+        {"CONNECTION", true},    {"cOnNeCtIoN", true},
+        {"Conn", false},         {"Connection-X", false},
+        {"Connectio", false},    {"Coxxxxxxxn", false},
+        {"Xonnection", false},   {"Connection\x80", false},
+        {"C", false},            {"Host", false},
+        {"Keep-Alive", false},   {"Connection ", false},
+        {"Connectixn", false},   {"Connecti\x0fn", false},
+    };
+
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        http_out_t o = handle(names[i].key, "keep-alive", 0);
+        CHECK(o.keep_alive == names[i].match);
+    }
+    CHECK(handle("Connection", "Keep-Alive", 0).keep_alive);
+    CHECK(!handle("Connection", "close", 0).keep_alive);
+}
+
+/* If-Modified-Since dates are read in GMT, whatever the local time zone, and
+ * only the exact modification time is not modified */
+static void test_if_modified_since()
+{
+    static const char *zones[] = {"UTC", "America/New_York", "Asia/Taipei"};
+    const char *date = "Wed, 21 Oct 2015 07:28:00 GMT";
+    time_t mtime = 1445412480;
+
+    for (size_t i = 0; i < sizeof(zones) / sizeof(zones[0]); i++) {
+        setenv("TZ", zones[i], 1);
+        tzset();
+        http_out_t o = handle("If-Modified-Since", date, mtime);
+        CHECK(!o.modified && o.status == HTTP_NOT_MODIFIED);
+        o = handle("IF-MODIFIED-SINCE", date, mtime);
+        CHECK(!o.modified);
+        CHECK(handle("If-Modified-Since", date, mtime + 1).modified);
+        CHECK(handle("If-Modified-Since", date, mtime - 3600).modified);
+        CHECK(handle("If-Modified-Since", "yesterday", mtime).modified);
+    }
+    unsetenv("TZ");
+    tzset();
+}
+
+int main()
+{
+    http_header_init();
+    for (size_t i = 0; i < N_HEADERS_IN; i++) {
+        /* The table is stored in lower case, which lookups rely on */
+        for (const char *c = http_headers_in[i].name; *c; c++)
+            CHECK(*c == tolower((unsigned char) *c));
+    }
+
+    test_fold();
+    test_lookup();
+    test_if_modified_since();
+    return 0;
+}
@@ -0,0 +1,427 @@
+#include <stdbool.h>
+#include <string.h>
+
+#include "pool.h"
+#include "test.h"
+
+/* The scanners are static, so the parser is built into this program */
+#include "../src/http_parser.c"
+
+#define MAX_REQS 8
+#define GEN_HEADERS 40 /* Past MAX_HEADERS, so some are malloc()-ed */
+#define MAX_URI 600
+#define MAX_KEY 40
+#define MAX_VALUE 300
+
+/* A generated request, as the parser should see it */
+typedef struct {
+    int method;
+    char uri[MAX_URI + 1];
+    int major, minor;
+    int nheaders;
+    char key[GEN_HEADERS][MAX_KEY + 1];
+    char value[GEN_HEADERS][MAX_VALUE + 1];
+    size_t len; /* Length of its text */
+} expect_t;
+
+typedef struct {
+    scan_fn fn;
+    bool supported;
+} scanner_t;
+
+static scanner_t scanners[3];
+static int nscanners;
+
+static char *ring; /* Mirrored, as read rings are */
+static http_header_t headers[MAX_HEADERS];
+
+static unsigned seed = 1;
+
+static size_t rnd_r(unsigned *state, size_t n)
+{
+    return n ? (size_t) rand_r(state) % n : 0;
+}
+
+static size_t rnd(size_t n)
+{
+    return rnd_r(&seed, n);
+}
+
+/* Random bytes of a class: URIs take anything but a space, CR and LF;
+ * header keys are tokens; values may also hold spaces and colons, just not
+ * first */
+static void rnd_str(char *s, size_t len, int cls)
+{
+    static const char token[] =
+        "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-_";
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c;
+        if (cls == 1) {
+            c = token[rnd(sizeof(token) - 1)];
+        } else {
+            do
+                c = 0x21 + rnd(0xff - 0x21 + 1);
+            while (c == ' ' || c == '\r' || c == '\n');
+            if (cls == 2 && i > 0 && rnd(8) == 0)
+                c = rnd(2) ? ' ' : ':';
+        }
+        s[i] = c;
+    }
+    s[len] = '\0';
+}
+
+/* Appends one random request to 'text' */
+static size_t gen_request(char *text, expect_t *e)
+{
+    static const struct {
+        const char *name;
+        int method;
+    } methods[] = {{"GET", HTTP_GET},
+                   {"HEAD", HTTP_HEAD},
+                   {"POST", HTTP_POST},
+                   {"DELETE", HTTP_UNKNOWN}};
+    int m = rnd(4);
+    size_t n = 0;
+
+    e->method = methods[m].method;
+    e->uri[0] = '/';
+    rnd_str(e->uri + 1, rnd(4) ? rnd(40) : rnd(MAX_URI), 0);
+    e->major = 1;
+    e->minor = rnd(2);
+    n += sprintf(text + n, "%s %s HTTP/%d.%d\r\n", methods[m].name, e->uri,
+                 e->major, e->minor);
+
+    /* The header parser expects at least one header line */
+    e->nheaders = 1 + rnd(GEN_HEADERS);
+    for (int h = 0; h < e->nheaders; h++) {
+        /* Long values only in the first few, so that requests fit the ring */
+        rnd_str(e->key[h], 1 + rnd(MAX_KEY), 1);
+        rnd_str(e->value[h], 1 + rnd(rnd(4) || h >= 12 ? 40 : MAX_VALUE), 2);
+        n += sprintf(text + n, "%s:%s%s\r\n", e->key[h], rnd(2) ? " " : "",
+                     e->value[h]);
+    }
+    n += sprintf(text + n, "\r\n");
+    e->len = n;
+    return n;
+}
+
+/* Copies the bytes from 'start' up to 'end', which the mirrored ring keeps
+ * contiguous even across the wrap */
+static void ring_str(char *s, void *start, void *end)
+{
+    size_t len = (char *) end - (char *) start;
+    CHECK(len < MAX_BUF);
+    memcpy(s, start, len);
+    s[len] = '\0';
+}
+
+/* Moves the next request back to the first view of the ring, as
+ * do_request() does once a request is handled */
+static void rebase(http_request_t *r)
+{
+    r->start = r->pos % MAX_BUF;
+    r->last = r->start + (r->last - r->pos);
+    r->pos = r->start;
+}
+
+static void check_request(http_request_t *r, const expect_t *e)
+{
+    char s[MAX_BUF];
+
+    CHECK(r->method == e->method);
+    ring_str(s, r->uri_start, r->uri_end);
+    CHECK(strcmp(s, e->uri) == 0);
+    CHECK(r->http_major == e->major && r->http_minor == e->minor);
+
+    /* Headers are pushed at the front of the list; the first MAX_HEADERS
+     * take the records of the request, if it has any */
+    int h = e->nheaders;
+    list_head *pos, *n;
+    list_for_each_safe (pos, n, &r->list) {
+        http_header_t *hd = list_entry(pos, http_header_t, list);
+        CHECK(--h >= 0);
+        CHECK((r->headers && h < MAX_HEADERS) == (hd == &r->headers[h]));
+        ring_str(s, hd->key_start, hd->key_end);
+        CHECK(strcmp(s, e->key[h]) == 0);
+        ring_str(s, hd->value_start, hd->value_end);
+        CHECK(strcmp(s, e->value[h]) == 0);
+        list_del(pos);
+        http_header_free(r, hd);
+    }
+    CHECK(h == 0);
+    r->nheaders = 0;
+}
+
+/* Feeds 'text' to the parser in random chunks drawn from 'split', starting
+ * at ring offset 'off', and checks every request parsed. The ring after
+ * the received data is filled with delimiters, so reading past it shows. */
+static void parse_stream(scan_fn fn,
+                         const char *text,
+                         size_t len,
+                         const expect_t *e,
+                         int nreqs,
+                         size_t off,
+                         unsigned split)
+{
+    http_request_t r;
+    size_t fed = 0;
+    bool line_done = false;
+    int done = 0;
+
+    scan = fn;
+    memset(&r, 0, sizeof(r));
+    r.buf = ring;
+    r.start = r.pos = r.last = off;
+    INIT_LIST_HEAD(&r.list);
+    /* Now and then, no records, as when their pool is exhausted */
+    r.headers = rnd_r(&split, 8) ? headers : NULL;
+
+    while (done < nreqs) {
+        /* Bytes of the current request must stay in place */
+        size_t room = MAX_BUF - 1 - (r.last - r.start);
+        for (size_t i = 0; i < room && i < 64; i++)
+            ring[r.last + i] = " \r\n:"[i % 4];
+
+        size_t n = rnd_r(&split, 4) ? 1 + rnd_r(&split, 8)
+                                    : 1 + rnd_r(&split, 2000);
+        if (n > room)
+            n = room;
+        if (n > len - fed)
+            n = len - fed;
+        CHECK(n > 0);
+        memcpy(ring + r.last, text + fed, n);
+        r.last += n;
+        fed += n;
+
+        while (done < nreqs) {
+            int rc;
+            if (!line_done) {
+                rc = http_parse_request_line(&r);
+                if (rc == EAGAIN)
+                    break;
+                CHECK(rc == 0);
+                line_done = true;
+            }
+            rc = http_parse_request_body(&r);
+            if (rc == EAGAIN)
+                break;
+            CHECK(rc == 0);
+
+            check_request(&r, &e[done]);
+            CHECK(r.pos == r.start + e[done].len);
+            rebase(&r);
+            line_done = false;
+            done++;
+        }
+    }
+    CHECK(fed == len && r.pos == r.last);
+}
+
+/* Parses 'text' like parse_stream(), for input that may be invalid, and
+ * writes what the parser made of it to 'trace': the fields of each request,
+ * then how parsing stopped */
+static void parse_trace(scan_fn fn,
+                        const char *text,
+                        size_t len,
+                        size_t off,
+                        unsigned split,
+                        char *trace)
+{
+    http_request_t r;
+    size_t fed = 0;
+    bool line_done = false;
+    char s[MAX_BUF];
+
+    scan = fn;
+    memset(&r, 0, sizeof(r));
+    r.buf = ring;
+    r.start = r.pos = r.last = off;
+    INIT_LIST_HEAD(&r.list);
+    r.headers = headers;
+    trace[0] = '\0';
+
+    for (;;) {
+        size_t room = MAX_BUF - 1 - (r.last - r.start);
+        if (fed == len || room == 0) {
+            strcat(trace, fed == len ? "[more]" : "[full]");
+            break;
+        }
+        for (size_t i = 0; i < room && i < 64; i++)
+            ring[r.last + i] = " \r\n:"[i % 4];
+
+        size_t n = split ? 1 + rnd_r(&split, 16) : room;
+        if (n > room)
+            n = room;
+        if (n > len - fed)
+            n = len - fed;
+        memcpy(ring + r.last, text + fed, n);
+        r.last += n;
+        fed += n;
+
+        int rc;
+        for (;;) {
+            if (!line_done) {
+                rc = http_parse_request_line(&r);
+                if (rc != 0)
+                    break;
+                line_done = true;
+            }
+            rc = http_parse_request_body(&r);
+            if (rc != 0)
+                break;
+
+            char *t = trace + strlen(trace);
+            ring_str(s, r.uri_start, r.uri_end);
+            t += sprintf(t, "%d %s %d.%d\n", r.method, s, r.http_major,
+                         r.http_minor);
+            list_head *pos, *next;
+            list_for_each_safe (pos, next, &r.list) {
+                http_header_t *hd = list_entry(pos, http_header_t, list);
+                ring_str(s, hd->key_start, hd->key_end);
+                t += sprintf(t, "%s=", s);
+                ring_str(s, hd->value_start, hd->value_end);
+                t += sprintf(t, "%s\n", s);
+                list_del(pos);
+                http_header_free(&r, hd);
+            }
+            r.nheaders = 0;
+            rebase(&r);
+            line_done = false;
+        }
+        if (rc != EAGAIN) {
+            sprintf(trace + strlen(trace), "[error %d]", rc);
+            break;
+        }
+    }
+
+    list_head *pos, *next;
+    list_for_each_safe (pos, next, &r.list) {
+        list_del(pos);
+        http_header_free(&r, list_entry(pos, http_header_t, list));
+    }
+}
+
+/* Damaged requests are parsed alike, or rejected alike, whichever scanner
+ * is used and however they are split */
+static void test_mutations()
+{
+    static const char junk[] = " :\r\n/HTTP1.\0\x80\xff";
+    static char text[MAX_REQS * (MAX_URI + 64 + GEN_HEADERS * 400)];
+    static char whole[1 << 20], trace[1 << 20];
+    expect_t e[MAX_REQS];
+
+    for (int round = 0; round < 3000; round++) {
+        int nreqs = 1 + rnd(4);
+        size_t len = 0;
+        for (int i = 0; i < nreqs; i++)
+            len += gen_request(text + len, &e[i]);
+
+        /* Overwrite, drop or repeat a few bytes */
+        for (int k = 1 + rnd(4); k > 0 && len > 1; k--) {
+            size_t at = rnd(len);
+            switch (rnd(3)) {
+            case 0:
+                text[at] = junk[rnd(sizeof(junk) - 1)];
+                break;
+            case 1:
+                memmove(text + at, text + at + 1, len - at - 1);
+                len--;
+                break;
+            default:
+                memmove(text + at + 1, text + at, len - at);
+                len++;
+                break;
+            }
+        }
+
+        size_t off = rnd(MAX_BUF);
+        parse_trace(scan_scalar, text, len, off, 0, whole);
+        for (int s = 0; s < nscanners; s++) {
+            if (!scanners[s].supported)
+                continue;
+            parse_trace(scanners[s].fn, text, len, off, 1 + rnd(~0U), trace);
+            CHECK(strcmp(trace, whole) == 0);
+        }
+    }
+}
+
+/* Every scanner finds the same delimiter in random data, at any alignment
+ * and for any length */
+static void test_scanners()
+{
+    uint8_t buf[256 + 64];
+
+    for (int round = 0; round < 200000; round++) {
+        size_t align = rnd(64), len = rnd(257);
+        uint8_t a = rnd(256), b = rnd(4) ? rnd(256) : a;
+        for (size_t i = 0; i < len; i++) {
+            /* Sparse delimiters, so long stretches are skipped too */
+            size_t r = rnd(64);
+            uint8_t c;
+            if (r < 2) {
+                c = r ? b : a;
+            } else {
+                do
+                    c = rnd(256);
+                while (c == a || c == b);
+            }
+            buf[align + i] = c;
+        }
+
+        size_t expect = scan_scalar(buf + align, len, a, b);
+        CHECK(expect <= len);
+        for (int s = 0; s < nscanners; s++)
+            if (scanners[s].supported)
+                CHECK(scanners[s].fn(buf + align, len, a, b) == expect);
+    }
+}
+
+/* Every scanner parses random requests alike, however they are split and
+ * wherever they lie in the ring */
+static void test_requests()
+{
+    static char text[MAX_REQS * (MAX_URI + 64 + GEN_HEADERS * 400)];
+    expect_t e[MAX_REQS];
+
+    for (int round = 0; round < 3000; round++) {
+        int nreqs = 1 + rnd(MAX_REQS);
+        size_t len = 0;
+        for (int i = 0; i < nreqs; i++)
+            len += gen_request(text + len, &e[i]);
+
+        size_t off = rnd(MAX_BUF);
+        unsigned split = rnd(~0U);
+        for (int s = 0; s < nscanners; s++)
+            if (scanners[s].supported)
+                parse_stream(scanners[s].fn, text, len, e, nreqs, off, split);
+    }
+}
+
+int main()
+{
+    pool_t rings;
+    CHECK(pool_init_mirror(&rings, MAX_BUF, 1) == 0);
+    ring = pool_alloc(&rings);
+    CHECK(ring);
+
+    scanners[nscanners++] = (scanner_t){scan_scalar, true};
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    scanners[nscanners++] =
+        (scanner_t){scan_sse42, __builtin_cpu_supports("sse4.2")};
+    scanners[nscanners++] =
+        (scanner_t){scan_avx2, __builtin_cpu_supports("avx2")};
+#endif
+
+    test_scanners();
+    test_requests();
+    test_mutations();
+
+    /* The scanner picked at startup is one of the supported ones */
+    http_parser_init();
+    bool found = false;
+    for (int s = 0; s < nscanners; s++)
+        found |= scanners[s].supported && scanners[s].fn == scan;
+    CHECK(found);
+    return 0;
+}
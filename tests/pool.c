@@ -0,0 +1,113 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "pool.h"
+#include "test.h"
+
+#define OBJ_SIZE 200 /* Rounded up to 256 by the pool */
+
+/* Fills every byte of an object with its index */
+static void fill(void *obj, size_t i)
+{
+    memset(obj, (int) (i & 0xff), OBJ_SIZE);
+}
+
+static int filled(const void *obj, size_t i)
+{
+    const unsigned char *c = obj;
+    for (size_t k = 0; k < OBJ_SIZE; k++)
+        if (c[k] != (i & 0xff))
+            return 0;
+    return 1;
+}
+
+/* Objects are aligned, never overlap and are handed out again once freed,
+ * across more than one slab */
+static void test_alloc(bool huge)
+{
+    pool_t pool;
+    size_t per_slab = POOL_SLAB_SIZE / 256, n = 3 * per_slab + 7;
+    void **objs = malloc(n * sizeof(*objs));
+
+    CHECK(pool_init(&pool, OBJ_SIZE, 100, huge) == 0);
+    CHECK(pool.size == 256);
+    CHECK(pool.slabs == 1 && pool.total == per_slab && pool.used == 0);
+
+    for (size_t i = 0; i < n; i++) {
+        objs[i] = pool_alloc(&pool);
+        CHECK(objs[i] && ((uintptr_t) objs[i] & 63) == 0);
+        fill(objs[i], i);
+    }
+    for (size_t i = 0; i < n; i++)
+        CHECK(filled(objs[i], i));
+    CHECK(pool.used == n && pool.peak == n && pool.slabs == 4);
+
+    /* Free every other object; they come back before new ones are carved */
+    for (size_t i = 0; i < n; i += 2)
+        pool_free(&pool, objs[i]);
+    CHECK(pool.used == n / 2);
+    size_t total = pool.total;
+    for (size_t i = 0; i < n; i += 2) {
+        objs[i] = pool_alloc(&pool);
+        fill(objs[i], i);
+    }
+    CHECK(pool.total == total && pool.peak == n && pool.failures == 0);
+    for (size_t i = 0; i < n; i++)
+        CHECK(filled(objs[i], i));
+
+    free(objs);
+}
+
+/* Preallocation spans as many slabs as the requested objects need */
+static void test_prealloc()
+{
+    pool_t pool;
+    size_t per_slab = POOL_SLAB_SIZE / 4096;
+
+    CHECK(pool_init(&pool, 4096, per_slab + 1, false) == 0);
+    CHECK(pool.slabs == 2 && pool.total == 2 * per_slab);
+    for (size_t i = 0; i < 2 * per_slab; i++)
+        CHECK(pool_alloc(&pool));
+    CHECK(pool.slabs == 2);
+    CHECK(pool_alloc(&pool) && pool.slabs == 3);
+}
+
+/* Both views of a mirrored object are the same memory, objects of one
+ * memory file do not share pages, and freed objects come back */
+static void test_mirror()
+{
+    pool_t pool;
+    size_t size = 8192, per_slab = POOL_SLAB_SIZE / size, n = per_slab + 3;
+    char **objs = malloc(n * sizeof(*objs));
+
+    CHECK(pool_init_mirror(&pool, size, 2) == 0);
+    CHECK(pool.total == 2 && pool.slabs == 1);
+
+    for (size_t i = 0; i < n; i++) {
+        objs[i] = pool_alloc(&pool);
+        CHECK(objs[i]);
+        memset(objs[i], (int) (i & 0xff), size);
+    }
+    CHECK(pool.slabs == 2 && pool.total == n);
+
+    for (size_t i = 0; i < n; i++) {
+        CHECK(objs[i][size] == (char) (i & 0xff));
+        CHECK(objs[i][2 * size - 1] == (char) (i & 0xff));
+        /* A write to the second view shows in the first */
+        objs[i][size + 100] = 'x';
+        CHECK(objs[i][100] == 'x');
+    }
+
+    pool_free(&pool, objs[5]);
+    CHECK(pool_alloc(&pool) == objs[5] && pool.total == n);
+    free(objs);
+}
+
+int main()
+{
+    test_alloc(false);
+    test_alloc(true);
+    test_prealloc();
+    test_mirror();
+    return 0;
+}
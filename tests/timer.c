@@ -0,0 +1,341 @@
+#include <time.h>
+
+#include "test.h"
+
+/* The wheel reads the time through clock_gettime(); a fake clock lets the
+ * checks place every tick exactly. The wheel's internals are checked too,
+ * so the module is built into this program rather than linked. */
+static size_t fake_msec;
+
+static int fake_clock_gettime(clockid_t clock, struct timespec *ts)
+{
+    (void) clock;
+    ts->tv_sec = fake_msec / 1000;
+    ts->tv_nsec = (fake_msec % 1000) * 1000000;
+    return 0;
+}
+
+#define clock_gettime fake_clock_gettime
+#include "../src/timer.c"
+#undef clock_gettime
+
+#define NREQ 512
+
+static http_request_t *reqs;
+static bool armed[NREQ];
+static size_t due[NREQ];      /* Expiration time of each timer */
+static bool fired[NREQ];
+static size_t fired_at[NREQ]; /* Time each timer fired at */
+static bool early_ok;         /* Timers may be expired ahead of time */
+
+static int on_expire(http_request_t *r)
+{
+    size_t i = r - reqs;
+    CHECK(armed[i] && !fired[i]);
+    CHECK(early_ok || due[i] <= current_msec); /* Never early */
+    fired[i] = true;
+    fired_at[i] = current_msec;
+    armed[i] = false;
+    return 0;
+}
+
+static void arm(size_t i, size_t timeout)
+{
+    add_timer(&reqs[i], timeout, on_expire);
+    armed[i] = true;
+    due[i] = fake_msec + timeout;
+    fired[i] = false;
+}
+
+static void disarm(size_t i)
+{
+    del_timer(&reqs[i]);
+    armed[i] = false;
+}
+
+/* Every timer that is due has fired, and only those */
+static void check_due()
+{
+    for (size_t i = 0; i < NREQ; i++)
+        CHECK(!armed[i] || due[i] > fake_msec);
+}
+
+/* Moves the clock forward and refreshes it, as epoll_wait() returning does */
+static void advance(size_t ms)
+{
+    fake_msec += ms;
+    time_update();
+}
+
+static void reset(size_t start)
+{
+    fake_msec = start;
+    timer_init();
+    for (size_t i = 0; i < NREQ; i++) {
+        timer_node_init(&reqs[i].timer);
+        armed[i] = fired[i] = false;
+    }
+    early_ok = false;
+}
+
+/* Stepping one tick at a time, each timer fires exactly when it is due, in
+ * every level of the wheel */
+static void test_exact(size_t start)
+{
+    static const size_t timeouts[] = {0,   1,    2,    63,    64,     65,
+                                      100, 4095, 4096, 4097,  5000,   262143,
+                                      262144, 300000};
+    size_t n = sizeof(timeouts) / sizeof(timeouts[0]);
+
+    reset(start);
+    for (size_t i = 0; i < n; i++)
+        arm(i, timeouts[i]);
+
+    while (fake_msec <= start + 300000) {
+        handle_expired_timers();
+        check_due();
+        advance(1);
+    }
+    for (size_t i = 0; i < n; i++)
+        CHECK(fired[i] && fired_at[i] == start + timeouts[i]);
+    CHECK(find_timer() == TIMER_INFINITE);
+}
+
+/* Sleeping exactly as long as find_timer() says, as the event loop does,
+ * never wakes up after a timer is due */
+static void test_sleep(size_t start)
+{
+    static const size_t timeouts[] = {3, 70, 500, 500, 4200, 70000, 1000000};
+    size_t n = sizeof(timeouts) / sizeof(timeouts[0]);
+
+    reset(start);
+    for (size_t i = 0; i < n; i++)
+        arm(i, timeouts[i]);
+
+    int wait;
+    while ((wait = find_timer()) != TIMER_INFINITE) {
+        CHECK(wait >= 0);
+        advance(wait);
+        handle_expired_timers();
+        check_due();
+    }
+    for (size_t i = 0; i < n; i++)
+        CHECK(fired[i] && fired_at[i] == start + timeouts[i]);
+}
+
+/* A lone timer far away wakes the loop up once per level it is cascaded
+ * through, not once per turn of the finest level */
+static void test_wakeups(size_t start)
+{
+    static const size_t timeouts[] = {10, 100, 5000, 100000, 300000, 10000000};
+
+    for (size_t i = 0; i < sizeof(timeouts) / sizeof(timeouts[0]); i++) {
+        reset(start);
+        arm(0, timeouts[i]);
+
+        int wait, wakeups = 0;
+        while ((wait = find_timer()) != TIMER_INFINITE) {
+            advance(wait);
+            handle_expired_timers();
+            wakeups++;
+        }
+        CHECK(fired[0] && fired_at[0] == start + timeouts[i]);
+        CHECK(wakeups <= WHEEL_LEVELS);
+    }
+}
+
+/* Disarmed timers never fire, and re-arming a timer moves it */
+static void test_del(size_t start)
+{
+    reset(start);
+    arm(0, 10);
+    arm(1, 10);
+    arm(2, 5000);
+    arm(3, 20);
+    disarm(1);
+    disarm(2);
+    arm(3, 100);
+    CHECK(wheel.count == 2);
+
+    advance(50);
+    handle_expired_timers();
+    CHECK(fired_at[0] == start + 50 && !fired[1] && !fired[3]);
+    advance(50);
+    handle_expired_timers();
+    CHECK(fired_at[3] == start + 100 && !fired[1] && !fired[2]);
+    CHECK(wheel.count == 0 && find_timer() == TIMER_INFINITE);
+    for (int l = 0; l < WHEEL_LEVELS; l++)
+        CHECK(wheel.busy[l] == 0);
+}
+
+/* Postponing a timer keeps it in its slot until the slot is reached, yet
+ * it fires exactly when last due; bringing it forward relinks it */
+static void test_postpone(size_t start)
+{
+    reset(start);
+    arm(0, 100);
+    list_head *slot = reqs[0].timer.link.prev;
+    for (int i = 0; i < 20; i++) {
+        advance(30);
+        handle_expired_timers();
+        arm(0, 100);
+        CHECK(!fired[0]);
+        if (i == 0)
+            CHECK(reqs[0].timer.link.prev == slot);
+    }
+    while (!fired[0]) {
+        advance(1);
+        handle_expired_timers();
+    }
+    CHECK(fired_at[0] == start + 20 * 30 + 100);
+
+    arm(1, 5000);
+    arm(1, 10);
+    advance(10);
+    handle_expired_timers();
+    CHECK(fired[1] && fired_at[1] == start + 20 * 30 + 100 + 10);
+    CHECK(wheel.count == 0);
+}
+
+/* Timers work from the time of the last refresh, not the current time */
+static void test_cached_clock(size_t start)
+{
+    reset(start);
+    fake_msec += 1000;
+    arm(0, 10);
+    due[0] = start + 10;
+    handle_expired_timers();
+    CHECK(!fired[0] && find_timer() == 10);
+    time_update();
+    CHECK(find_timer() == 0);
+    handle_expired_timers();
+    CHECK(fired[0] && fired_at[0] == start + 1000);
+}
+
+/* Timers expired ahead of time go in the order they are due, postponed
+ * ones by their new time, and only within the given horizon */
+static void test_expire_oldest(size_t start)
+{
+    static const size_t timeouts[] = {300, 100, 5000, 200, 70, 100000, 10};
+    static const size_t order[] = {6, 4, 3, 0, 1, 2, 5};
+    size_t n = sizeof(timeouts) / sizeof(timeouts[0]);
+
+    reset(start);
+    for (size_t i = 0; i < n; i++)
+        arm(i, timeouts[i]);
+    advance(5);
+    arm(1, 400); /* Postponed in place, due after 0 now */
+
+    early_ok = true;
+    CHECK(!expire_oldest_timer(0, NULL));
+    for (size_t k = 0; k < n; k++) {
+        size_t i = order[k];
+        CHECK(expire_oldest_timer(due[i] - fake_msec, NULL));
+        CHECK(fired[i]);
+        for (size_t j = k + 1; j < n; j++)
+            CHECK(!fired[order[j]]);
+        if (k + 1 < n)
+            CHECK(!expire_oldest_timer(due[order[k + 1]] - fake_msec - 1,
+                                       NULL));
+    }
+    CHECK(!expire_oldest_timer(SIZE_MAX, NULL) && wheel.count == 0);
+}
+
+static bool odd(http_request_t *r)
+{
+    return (r - reqs) % 2;
+}
+
+/* Timers the filter passes over stay armed where they are, wherever they
+ * sit in the order; the others still expire oldest first */
+static void test_expire_filter(size_t start)
+{
+    static const size_t timeouts[] = {10, 20, 30, 40, 70, 5000, 100000};
+    size_t n = sizeof(timeouts) / sizeof(timeouts[0]);
+
+    reset(start);
+    for (size_t i = 0; i < n; i++)
+        arm(i, timeouts[i]);
+
+    early_ok = true;
+    for (size_t i = 1; i < n; i += 2) {
+        CHECK(expire_oldest_timer(SIZE_MAX, odd));
+        for (size_t j = 0; j < n; j++)
+            CHECK(fired[j] == (j % 2 && j <= i));
+    }
+    CHECK(!expire_oldest_timer(SIZE_MAX, odd) && wheel.count == 4);
+
+    /* The timers passed over still fire when due */
+    early_ok = false;
+    while (wheel.count) {
+        advance(1);
+        handle_expired_timers();
+        check_due();
+    }
+    for (size_t i = 0; i < n; i += 2)
+        CHECK(fired[i] && fired_at[i] == start + timeouts[i]);
+}
+
+/* Random arming, disarming and clock jumps against the expected times */
+static void test_random(size_t start, unsigned seed)
+{
+    srand(seed);
+    reset(start);
+
+    for (int round = 0; round < 200000; round++) {
+        size_t i = rand() % NREQ;
+        switch (rand() % 8) {
+        case 0:
+            disarm(i);
+            break;
+        case 1:
+            advance(rand() % 5000);
+            handle_expired_timers();
+            check_due();
+            break;
+        case 2:
+            arm(i, rand() % 1000000);
+            break;
+        default:
+            arm(i, rand() % 600);
+            break;
+        }
+
+        if (round % 64 == 0) {
+            int wait = find_timer();
+            size_t count = 0;
+            for (size_t k = 0; k < NREQ; k++)
+                count += armed[k];
+            CHECK(count == wheel.count);
+            CHECK((wait == TIMER_INFINITE) == (count == 0));
+            /* Nothing is due before the wheel asks to run, except timers
+             * armed with no timeout after the current tick was handled:
+             * those expire on the next tick */
+            for (size_t k = 0; wait > 0 && k < NREQ; k++)
+                CHECK(!armed[k] || due[k] >= fake_msec + wait ||
+                      (due[k] == fake_msec && wait == 1));
+        }
+    }
+}
+
+int main()
+{
+    reqs = calloc(NREQ, sizeof(*reqs));
+    CHECK(reqs);
+
+    size_t starts[] = {0, 1, 63, 4095, 1700000000000, 1700000262143};
+    for (size_t s = 0; s < sizeof(starts) / sizeof(starts[0]); s++) {
+        test_exact(starts[s]);
+        test_sleep(starts[s]);
+        test_wakeups(starts[s]);
+        test_del(starts[s]);
+        test_postpone(starts[s]);
+        test_cached_clock(starts[s]);
+        test_expire_oldest(starts[s]);
+        test_expire_filter(starts[s]);
+        test_random(starts[s], s + 1);
+    }
+
+    free(reqs);
+    return 0;
+}